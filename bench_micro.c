@@ -0,0 +1,337 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Microbenchmarks of buflib, next to libc doing the same where it can.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "buflib.h"
+#include "new_apis.h"
+#include "buflib_slab.h"
+#include "buflib_copy.h"
+
+/* Usage: bench_micro [scale], run by "make bench".
+ *
+ * Every benchmark prints nanoseconds per operation for buflib and, where
+ * there's an equivalent, for malloc (or memmove for moving data). The random patterns are seeded the same
+ * for both. scale multiplies the number of operations (default 1).
+ */
+
+#define BUFFER_SIZE (64<<20)
+#define SLOTS 4096
+
+static struct buflib_context ctx;
+static char *buffer;
+static int handles[SLOTS];
+static void *pointers[SLOTS];
+static size_t sizes[SLOTS];
+static int scale = 1;
+static volatile unsigned sink;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void reset(void)
+{
+    buflib_init(&ctx, buffer, BUFFER_SIZE);
+    memset(handles, 0, sizeof(handles));
+    memset(pointers, 0, sizeof(pointers));
+}
+
+static void report(const char *name, double buflib_ns, double malloc_ns)
+{
+    if (malloc_ns >= 0)
+        printf("%-32s %10.1f %10.1f\n", name, buflib_ns, malloc_ns);
+    else
+        printf("%-32s %10.1f %10s\n", name, buflib_ns, "-");
+}
+
+static void free_all(void)
+{
+    int i;
+    for (i = 0; i < SLOTS; i++)
+    {
+        if (handles[i] > 0)
+            buflib_free(&ctx, handles[i]);
+        free(pointers[i]);
+    }
+    reset();
+}
+
+/* random alloc/free in a set of slots, each alloc is touched once */
+static void bench_churn(const char *name, size_t min, size_t max)
+{
+    long n = 1000000L * scale, i;
+    uint64_t start;
+    double t_buflib, t_malloc;
+
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        int slot = rand() % SLOTS;
+        if (handles[slot] > 0)
+        {
+            buflib_free(&ctx, handles[slot]);
+            handles[slot] = 0;
+        }
+        else
+        {
+            size_t size = min + rand() % (max - min + 1);
+            handles[slot] = buflib_alloc_ex(&ctx, size, "", &ops);
+            if (handles[slot] > 0)
+                *(char*)buflib_get_data(&ctx, handles[slot]) = 1;
+        }
+    }
+    t_buflib = (double)(now_ns() - start) / n;
+
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        int slot = rand() % SLOTS;
+        if (pointers[slot])
+        {
+            free(pointers[slot]);
+            pointers[slot] = NULL;
+        }
+        else
+        {
+            size_t size = min + rand() % (max - min + 1);
+            pointers[slot] = malloc(size);
+            *(char*)pointers[slot] = 1;
+        }
+    }
+    t_malloc = (double)(now_ns() - start) / n;
+    report(name, t_buflib, t_malloc);
+    free_all();
+}
+
+/* random alloc/free of 32 byte objects in slabs */
+static void bench_slab(void)
+{
+    static struct buflib_slab slab;
+    long n = 1000000L * scale, i;
+    uint64_t start;
+    double t_buflib, t_malloc;
+
+    buflib_slab_init(&slab, &ctx, 32, 0, "");
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        int slot = rand() % SLOTS;
+        if (handles[slot] > 0)
+        {
+            buflib_slab_free(&slab, handles[slot]);
+            handles[slot] = 0;
+        }
+        else
+        {
+            handles[slot] = buflib_slab_alloc(&slab);
+            *(char*)buflib_slab_get(&slab, handles[slot]) = 1;
+        }
+    }
+    t_buflib = (double)(now_ns() - start) / n;
+    buflib_slab_destroy(&slab);
+    memset(handles, 0, sizeof(handles));
+
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        int slot = rand() % SLOTS;
+        if (pointers[slot])
+        {
+            free(pointers[slot]);
+            pointers[slot] = NULL;
+        }
+        else
+        {
+            pointers[slot] = malloc(32);
+            *(char*)pointers[slot] = 1;
+        }
+    }
+    t_malloc = (double)(now_ns() - start) / n;
+    report("slab churn 32 bytes", t_buflib, t_malloc);
+    free_all();
+}
+
+/* reading through handles against reading through plain pointers */
+static void bench_get_data(void)
+{
+    long n = 10000000L * scale, i;
+    unsigned sum = 0;
+    uint64_t start;
+    double t_buflib, t_malloc;
+    int *order = malloc(SLOTS * sizeof(*order));
+
+    for (i = 0; i < SLOTS; i++)
+    {
+        handles[i] = buflib_alloc_ex(&ctx, 64, "", &ops);
+        pointers[i] = malloc(64);
+        *(char*)buflib_get_data(&ctx, handles[i]) = i;
+        *(char*)pointers[i] = i;
+    }
+    srand(1);
+    for (i = 0; i < SLOTS; i++)
+        order[i] = rand() % SLOTS;
+
+    start = now_ns();
+    for (i = 0; i < n; i++)
+        sum += *(char*)buflib_get_data(&ctx, handles[order[i % SLOTS]]);
+    t_buflib = (double)(now_ns() - start) / n;
+    start = now_ns();
+    for (i = 0; i < n; i++)
+        sum += *(char*)pointers[order[i % SLOTS]];
+    t_malloc = (double)(now_ns() - start) / n;
+    sink = sum;
+    report("get_data", t_buflib, t_malloc);
+    free(order);
+    free_all();
+}
+
+/* fill the buffer, free all but a fraction and time compacting it, per
+ * block that was left (and moved, mostly) */
+static void bench_compact(const char *name, int live_percent, size_t size)
+{
+    int rounds = 10 * scale, r, i, live = 0;
+    uint64_t total = 0, start;
+    for (r = 0; r < rounds; r++)
+    {
+        srand(r);
+        for (i = 0; i < SLOTS; i++)
+            handles[i] = buflib_alloc_ex(&ctx, size, "", &ops);
+        for (i = 0; i < SLOTS; i++)
+        {
+            if (rand() % 100 >= live_percent)
+                buflib_free(&ctx, handles[i]);
+            else
+                live++;
+        }
+        start = now_ns();
+        buflib_compact_step(&ctx, 0);
+        total += now_ns() - start;
+        reset();
+    }
+    report(name, (double)total / (live ? live : 1), -1);
+}
+
+/* cut allocations in half from the back, against realloc() doing the same */
+static void bench_shrink(void)
+{
+    int rounds = 100 * scale, r, i;
+    uint64_t t_buflib = 0, t_malloc = 0, start;
+    for (r = 0; r < rounds; r++)
+    {
+        for (i = 0; i < SLOTS; i++)
+        {
+            sizes[i] = 256 + i % 1024;
+            handles[i] = buflib_alloc_ex(&ctx, sizes[i], "", &ops);
+            pointers[i] = malloc(sizes[i]);
+        }
+        start = now_ns();
+        for (i = 0; i < SLOTS; i++)
+            buflib_shrink(&ctx, handles[i], buflib_get_data(&ctx, handles[i]),
+                          sizes[i] / 2);
+        t_buflib += now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < SLOTS; i++)
+            pointers[i] = realloc(pointers[i], sizes[i] / 2);
+        t_malloc += now_ns() - start;
+        free_all();
+    }
+    report("shrink by half", (double)t_buflib / (rounds * SLOTS),
+           (double)t_malloc / (rounds * SLOTS));
+}
+
+/* move size bytes by shift and back, against memmove(). Per move. With
+ * stream set, always bypassing the cache */
+static void bench_move(const char *name, size_t size, size_t shift,
+                       bool stream)
+{
+    size_t stream_min = buflib_stream_min;
+    long n = (256L << 20) / size * scale, i;
+    uint64_t start;
+    double t_buflib, t_memmove;
+
+    if (stream)
+        buflib_stream_min = 0;
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        buflib_move_data(buffer + shift, buffer, size);
+        buflib_move_data(buffer, buffer + shift, size);
+    }
+    t_buflib = (double)(now_ns() - start) / (2 * n);
+    buflib_stream_min = stream_min;
+    start = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        memmove(buffer + shift, buffer, size);
+        memmove(buffer, buffer + shift, size);
+    }
+    t_memmove = (double)(now_ns() - start) / (2 * n);
+    report(name, t_buflib, t_memmove);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+    buffer = malloc(BUFFER_SIZE);
+    reset();
+
+    printf("%-32s %10s %10s\n", "ns/op", "buflib", "libc");
+    bench_churn("churn 16-128 bytes", 16, 128);
+    bench_churn("churn 128-4096 bytes", 128, 4096);
+    bench_churn("churn 4096-16384 bytes", 4096, 16384);
+    bench_slab();
+    bench_get_data();
+    bench_compact("compact 10% live, 256 bytes", 10, 256);
+    bench_compact("compact 50% live, 256 bytes", 50, 256);
+    bench_compact("compact 90% live, 256 bytes", 90, 256);
+    bench_compact("compact 50% live, 8192 bytes", 50, 8192);
+    bench_shrink();
+    bench_move("move 64K by 64 bytes", 64<<10, 64, false);
+    bench_move("move 1M by 64 bytes", 1<<20, 64, false);
+    bench_move("move 1M by 1M", 1<<20, 1<<20, false);
+    bench_move("move 16M by 64 bytes", 16<<20, 64, false);
+    bench_move("move 16M by 16M", 16<<20, 16<<20, false);
+    bench_move("stream 1M by 64 bytes", 1<<20, 64, true);
+    bench_move("stream 16M by 64 bytes", 16<<20, 64, true);
+    bench_move("stream 16M by 16M", 16<<20, 16<<20, true);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Replays a trace recorded with buflib_trace_start() against a fresh context
+* and reports how the allocator did.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/* Usage: bench_replay <trace> [buffer size]
+ *
+ * The buffer size defaults to the one the trace was recorded with. Movable
+ * allocations are replayed with a move callback that does nothing, shrinkable
+ * ones refuse to shrink since the shrinks that happened are in the trace.
+ *
+ * "make bench" builds it optimized and without DEBUG.
+ */
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks movable_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+/* recorded handles map to the ones of the replay */
+static int *handles;
+static size_t num_handles;
+
+static void map_handle(int recorded, int handle)
+{
+    if ((size_t)recorded >= num_handles)
+    {
+        size_t num = num_handles ? num_handles : 256;
+        while (num <= (size_t)recorded)
+            num *= 2;
+        handles = realloc(handles, num * sizeof(*handles));
+        memset(handles + num_handles, 0, (num - num_handles) * sizeof(*handles));
+        num_handles = num;
+    }
+    handles[recorded] = handle;
+}
+
+static int replay_handle(int recorded)
+{
+    return (recorded > 0 && (size_t)recorded < num_handles) ? handles[recorded] : 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    struct buflib_context ctx;
+    struct buflib_trace_record record, *records;
+    struct buflib_stats stats;
+    size_t num = 0, max = 1024, i, size, calls = 0;
+    unsigned long failed = 0, skipped = 0;
+    char name[BUFLIB_TRACE_NAME_MASK + 1];
+    uint64_t *latency, total = 0;
+    FILE *file;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace> [buffer size]\n", argv[0]);
+        return 2;
+    }
+    file = fopen(argv[1], "rb");
+    if (!file || fread(&record, sizeof(record), 1, file) != 1
+              || record.op != BUFLIB_TRACE_INIT)
+    {
+        fprintf(stderr, "%s: not a buflib trace\n", argv[1]);
+        return 1;
+    }
+    size = argc > 2 ? strtoul(argv[2], NULL, 0) : record.a;
+    /* read it all first, reading must not count */
+    records = malloc(max * sizeof(*records));
+    while (fread(&records[num], sizeof(*records), 1, file) == 1)
+        if (++num == max)
+            records = realloc(records, (max *= 2) * sizeof(*records));
+    fclose(file);
+    latency = malloc((num ? num : 1) * sizeof(*latency));
+    memset(name, 'x', sizeof(name));
+
+    buflib_init(&ctx, malloc(size), size);
+    for (i = 0; i < num; i++)
+    {
+        struct buflib_trace_record *r = &records[i];
+        struct buflib_callbacks *ops = NULL;
+        int handle = 0;
+        uint64_t start;
+        if (r->op == BUFLIB_TRACE_ALLOC || r->op == BUFLIB_TRACE_ALLOC_MAXIMUM)
+        {
+            name[r->b & BUFLIB_TRACE_NAME_MASK] = '\0';
+            if (r->b & BUFLIB_TRACE_MOVABLE)
+                ops = &movable_ops;
+        }
+        else if (r->op == BUFLIB_TRACE_FREE || r->op == BUFLIB_TRACE_SHRINK
+                 || r->op == BUFLIB_TRACE_REALLOC)
+        {
+            handle = replay_handle(r->handle);
+            /* the allocation failed in the replay, there's no call to time */
+            if (handle <= 0)
+            {
+                skipped++;
+                continue;
+            }
+        }
+
+        start = now_ns();
+        switch (r->op)
+        {
+            case BUFLIB_TRACE_ALLOC:
+                handle = buflib_alloc_flags(&ctx, r->a, name, ops,
+                                    r->b >> BUFLIB_TRACE_ALLOC_FLAGS_SHIFT);
+                break;
+            case BUFLIB_TRACE_ALLOC_MAXIMUM:
+            {
+                size_t max_size;
+                handle = buflib_alloc_maximum(&ctx, name, &max_size, ops);
+                break;
+            }
+            case BUFLIB_TRACE_FREE:
+                buflib_free(&ctx, handle);
+                break;
+            case BUFLIB_TRACE_SHRINK:
+            {
+                char *data = buflib_get_data(&ctx, handle);
+                if (!buflib_shrink(&ctx, handle, data + r->a, r->b))
+                    failed++;
+                break;
+            }
+            case BUFLIB_TRACE_BUFFER_OUT:
+            {
+                size_t out = r->a;
+                buflib_buffer_out(&ctx, &out);
+                break;
+            }
+            case BUFLIB_TRACE_BUFFER_IN:
+                buflib_buffer_in(&ctx, r->a);
+                break;
+            case BUFLIB_TRACE_REALLOC:
+                if (!buflib_realloc(&ctx, handle, r->a))
+                    failed++;
+                break;
+        }
+        latency[calls] = now_ns() - start;
+        total += latency[calls++];
+
+        if (r->op == BUFLIB_TRACE_ALLOC || r->op == BUFLIB_TRACE_ALLOC_MAXIMUM)
+        {
+            name[r->b & BUFLIB_TRACE_NAME_MASK] = 'x';
+            if (r->handle > 0)
+                map_handle(r->handle, handle);
+            if (handle <= 0 && r->handle > 0)
+                failed++;
+        }
+    }
+
+    buflib_get_stats(&ctx, &stats);
+    qsort(latency, calls, sizeof(*latency), compare_ns);
+    printf("%zu calls in %.3f ms, %.0f calls/s\n", calls, total / 1e6,
+           total ? calls * 1e9 / total : 0.0);
+    if (calls)
+        printf("latency ns: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+               (unsigned long long)latency[calls/2],
+               (unsigned long long)latency[calls*9/10],
+               (unsigned long long)latency[calls*99/100],
+               (unsigned long long)latency[calls*999/1000],
+               (unsigned long long)latency[calls-1]);
+    printf("compactions %lu, moved %llu bytes, shrink callbacks %lu\n",
+           stats.compactions, (unsigned long long)stats.moved_bytes,
+           stats.shrink_calls);
+    printf("failed where the recording succeeded %lu, skipped %lu\n",
+           failed, skipped);
+    return 0;
+}
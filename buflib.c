@@ -24,9 +24,11 @@
 ****************************************************************************/
 
 #include <stdlib.h> /* for abs() */
+#include <limits.h>
+#include <errno.h>
 #include "buflib.h"
 #include "new_apis.h"
-#include "strlcpy.h"
+#include "buflib_copy.h"
 /* The main goal of this design is fast fetching of the pointer for a handle.
  * For that reason, the handles are stored in a table at the end of the buffer
  * with a fixed address, so that returning the pointer for a handle is a simple
@@ -37,10 +39,25 @@
  * are marked by negative length, allocated ones use the a buflib_data in
  * the block to store a pointer to their handle table entry, so that it can be
  * quickly found and updated during compaction. Followed by that, there's
- * the pointer to the corresponding struct buflib. That pointer follows a
- * character array containing the string identifier of the allocation. After the
- * array there is another buflib_data containing the length of that string +
- * the sizeo of this buflib_data.
+ * the pointer to the corresponding struct buflib. After that there is another
+ * buflib_data containing the id of the allocation's name, the names
+ * themselves are kept once in a table in the context (and the pin count).
+ * The data follows, so that the header has a fixed size of 4 buflib_data.
+ * On 64-bit hosts the header is compacted to 2 buflib_data: the length,
+ * then the index of the handle table entry and a 32-bit word with the
+ * name id, the pin count and the index of the ops in a table in the context.
+ * Free blocks repeat their negative length in their last buflib_data as a
+ * boundary tag. Allocated blocks that follow a free block have the lowest bit
+ * of the pointer to their handle table entry set, so that the free block
+ * before them, and its length, can be found without walking the buffer.
+ * No two free blocks are ever adjacent, they are merged instead.
+ * Free blocks big enough to hold two links are kept in doubly linked lists,
+ * one per power-of-two size class, with a bitmap of the non-empty classes.
+ * The link to the next free block of the class follows the length marker,
+ * the link to the previous one comes after that. An allocation takes a
+ * fitting block from the lists without walking the buffer, smaller free
+ * fragments are only reclaimed by merging with their neighbours or by
+ * compaction.
  * The allocator functions are passed a context struct so that two allocators
  * can be run, for example, one per core may be used, with convenience wrappers
  * for the single-allocator case that use a predefined context.
@@ -53,6 +70,15 @@
  */
 static struct buflib_callbacks default_callbacks;
 
+#if defined(ROCKBOX)
+#include "file.h"
+#else
+#include <unistd.h>
+#endif
+#ifdef BUFLIB_HAVE_VM
+#include <sys/mman.h>
+#endif
+
 #if defined(ROCKBOX)
 #define YIELD() yield()
 #elif defined(__unix) && (__unix == 1)
@@ -74,51 +100,581 @@ static struct buflib_callbacks default_callbacks;
 #define B_ALIGN_UP(x) \
     _ALIGN_UP(x, sizeof(union buflib_data))
 
+/* Free blocks of at least this many units are indexed in the size classes,
+ * smaller fragments can't satisfy any allocation anyway */
+#define BUFLIB_MIN_FREE 4
+
+/* Set in the handle table back-pointer of blocks preceded by a free block */
+#define BUFLIB_PREV_FREE 1
+
+#ifdef BUFLIB_COMPACT_HEADER
+/* Get the handle table entry of an allocated block */
+static inline union buflib_data*
+block_handle(struct buflib_context *ctx, union buflib_data *block)
+{
+    return ctx->handle_table - (block[1].hdr.handle >> 1);
+}
+
+static inline void
+block_set_handle(struct buflib_context *ctx, union buflib_data *block,
+                 union buflib_data *handle)
+{
+    block[1].hdr.handle = (ctx->handle_table - handle) << 1;
+}
+
+/* Check whether the block before an allocated block is free */
+static inline bool
+block_prev_free(union buflib_data *block)
+{
+    return block[1].hdr.handle & BUFLIB_PREV_FREE;
+}
+
+static inline void
+block_set_prev_free(union buflib_data *block, bool prev_free)
+{
+    if (prev_free)
+        block[1].hdr.handle |= BUFLIB_PREV_FREE;
+    else
+        block[1].hdr.handle &= ~BUFLIB_PREV_FREE;
+}
+
+/* Get the index of the ops of an allocated block in the table */
+static inline int
+block_ops_index(union buflib_data *block)
+{
+    return (block[1].hdr.info >> BUFLIB_NAME_ID_BITS) & BUFLIB_OPS_MASK;
+}
+
+/* Get the ops of an allocated block */
+static inline struct buflib_callbacks*
+block_ops(struct buflib_context *ctx, union buflib_data *block)
+{
+    return ctx->ops[block_ops_index(block)];
+}
+#else
+static inline union buflib_data*
+block_handle(struct buflib_context *ctx, union buflib_data *block)
+{
+    (void)ctx;
+    return (union buflib_data*)(block[1].val & ~(intptr_t)BUFLIB_PREV_FREE);
+}
+
+static inline void
+block_set_handle(struct buflib_context *ctx, union buflib_data *block,
+                 union buflib_data *handle)
+{
+    (void)ctx;
+    block[1].handle = handle;
+}
+
+static inline bool
+block_prev_free(union buflib_data *block)
+{
+    return block[1].val & BUFLIB_PREV_FREE;
+}
+
+static inline void
+block_set_prev_free(union buflib_data *block, bool prev_free)
+{
+    if (prev_free)
+        block[1].val |= BUFLIB_PREV_FREE;
+    else
+        block[1].val &= ~(intptr_t)BUFLIB_PREV_FREE;
+}
+
+static inline struct buflib_callbacks*
+block_ops(struct buflib_context *ctx, union buflib_data *block)
+{
+    (void)ctx;
+    return block[2].ops;
+}
+#endif
+
+/* Mark len units at block as free, setting up both length marker and
+ * boundary tag */
+static inline void
+mark_free(union buflib_data *block, intptr_t len)
+{
+    block[0].val = -len;
+    block[len-1].val = -len;
+}
+
+/* Get the length of a block in units, free or allocated */
+static inline intptr_t
+block_len(union buflib_data *block)
+{
+    return block->val < 0 ? -block->val : block->val;
+}
+
+/* How many blocks of the exact size class are looked at before falling back
+ * to a bigger class, which is guaranteed to fit */
+#define BUFLIB_BIN_SCAN 8
+
+/* Get the size class of a free block of len units */
+static inline int
+bin_index(intptr_t len)
+{
+    int bin = sizeof(long)*8 - 1 - __builtin_clzl(len);
+    return bin < BUFLIB_NUM_BINS ? bin : BUFLIB_NUM_BINS - 1;
+}
+
+/* Add a free block to the list of its size class. The length marker must
+ * already be set up. Every free block in front of alloc_end passes through
+ * here, also the ones too small to be listed, so that the free space they
+ * add up to is known.
+ */
+static void
+free_insert(struct buflib_context *ctx, union buflib_data *block)
+{
+    intptr_t len = -block->val;
+    ctx->free_units += len;
+    ctx->stats.holes++;
+    if (len < BUFLIB_MIN_FREE)
+        return;
+    int bin = bin_index(len);
+    union buflib_data *next = ctx->free_bins[bin];
+    block[1].handle = next;
+    block[2].handle = NULL;
+    if (next)
+        next[2].handle = block;
+    ctx->free_bins[bin] = block;
+    ctx->free_bins_map |= 1u << bin;
+}
+
+/* Remove a free block from the list of its size class. The length marker must
+ * not have changed since the block was inserted.
+ */
+static void
+free_remove(struct buflib_context *ctx, union buflib_data *block)
+{
+    intptr_t len = -block->val;
+    ctx->free_units -= len;
+    ctx->stats.holes--;
+    if (len < BUFLIB_MIN_FREE)
+        return;
+    int bin = bin_index(len);
+    union buflib_data *next = block[1].handle, *prev = block[2].handle;
+    if (prev)
+        prev[1].handle = next;
+    else if (!(ctx->free_bins[bin] = next))
+        ctx->free_bins_map &= ~(1u << bin);
+    if (next)
+        next[2].handle = prev;
+}
+
+/* Find a free block of at least size units, returning NULL if there's none.
+ * The block is not removed from its list.
+ */
+static union buflib_data*
+free_find(struct buflib_context *ctx, size_t size)
+{
+    union buflib_data *block;
+    int bin = bin_index(size), scanned = 0;
+    /* blocks in the exact size class may or may not fit, try a few of them
+     * first to avoid splitting bigger blocks needlessly */
+    for (block = ctx->free_bins[bin]; block; block = block[1].handle)
+    {
+        if ((size_t)-block->val >= size)
+            return block;
+        if (++scanned == BUFLIB_BIN_SCAN)
+            break;
+    }
+    /* any block in a bigger class fits */
+    uint32_t map = ctx->free_bins_map & ~((2u << bin) - 1);
+    if (map)
+        return ctx->free_bins[__builtin_ctz(map)];
+    /* nothing bigger available, finish the scan of the exact class */
+    for (; block; block = block[1].handle)
+        if ((size_t)-block->val >= size)
+            return block;
+    return NULL;
+}
+
+/* Find a free block of at least size units that starts in [lo, hi), looking
+ * at a few blocks of each size class. Returns NULL if none was found.
+ */
+static union buflib_data*
+free_find_in(struct buflib_context *ctx, size_t size,
+             union buflib_data *lo, union buflib_data *hi)
+{
+    uint32_t map = ctx->free_bins_map & ~((1u << bin_index(size)) - 1);
+    while (map)
+    {
+        union buflib_data *block;
+        int bin = __builtin_ctz(map), scanned = 0;
+        map &= map - 1;
+        for (block = ctx->free_bins[bin]; block && scanned < BUFLIB_BIN_SCAN;
+             block = block[1].handle, scanned++)
+            if ((size_t)-block->val >= size && block >= lo && block < hi)
+                return block;
+    }
+    return NULL;
+}
+
+/* Drop all allocations of a context, keeping its buffer */
+static void
+context_clear(struct buflib_context *ctx)
+{
+    /* The handle table is initialized with no entries */
+    ctx->last_handle = ctx->handle_table;
+    ctx->first_free_handle = NULL;
+    ctx->first_free_block = ctx->buf_start;
+    ctx->fixed_end = ctx->buf_start;
+    /* A marker is needed for the end of allocated data, to make sure that it
+     * does not collide with the handle table, and to detect end-of-buffer.
+     */
+    ctx->alloc_end = ctx->buf_start;
+    ctx->compact_cursor = NULL;
+    memset(ctx->free_bins, 0, sizeof(ctx->free_bins));
+    ctx->free_bins_map = 0;
+    ctx->free_units = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    memset(ctx->names.recent, 0, sizeof(ctx->names.recent));
+    ctx->names.used = 0;
+    memset(ctx->names.refs, 0, sizeof(ctx->names.refs));
+#ifdef BUFLIB_COMPACT_HEADER
+    memset(ctx->ops, 0, sizeof(ctx->ops));
+    memset(ctx->ops_refs, 0, sizeof(ctx->ops_refs));
+    ctx->ops[0] = &default_callbacks;
+#endif
+    ctx->handle_lock = 0;
+    ctx->pinned = 0;
+    ctx->compact = true;
+}
+
 /* Initialize buffer manager */
 void
 buflib_init(struct buflib_context *ctx, void *buf, size_t size)
 {
     union buflib_data *bd_buf = buf;
 
+    buflib_copy_init();
     /* Align on sizeof(buflib_data), to prevent unaligned access */
     ALIGN_BUFFER(bd_buf, size, sizeof(union buflib_data));
     size /= sizeof(union buflib_data);
-    /* The handle table is initialized with no entries */
     ctx->handle_table = bd_buf + size;
-    ctx->last_handle = bd_buf + size;
-    ctx->first_free_handle = bd_buf + size - 1;
-    ctx->first_free_block = bd_buf;
     ctx->buf_start = bd_buf;
-    /* A marker is needed for the end of allocated data, to make sure that it
-     * does not collide with the handle table, and to detect end-of-buffer.
-     */
-    ctx->alloc_end = bd_buf;
-    ctx->compact = true;
+    context_clear(ctx);
+#ifdef BUFLIB_HAVE_THREADS
+    ctx->threadsafe = false;
+    ctx->compactor = NULL;
+#endif
+#ifdef BUFLIB_HAVE_TRACE
+    ctx->trace = NULL;
+#endif
+#ifdef BUFLIB_HAVE_VM
+    ctx->reserve = NULL;
+    ctx->page_return_min = 0;
+#endif
+}
+
+#ifdef BUFLIB_HAVE_VM
+/* Initialize buffer manager with a buffer of size bytes that grows as needed,
+ * up to max_size bytes. The address space for max_size is reserved, memory
+ * is only committed as the buffer grows. Returns false if reserving fails,
+ * buflib_release() gives it back.
+ */
+bool
+buflib_init_growable(struct buflib_context *ctx, size_t size, size_t max_size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *reserve;
+    max_size = ALIGN_UP(max_size, page);
+    size = ALIGN_UP(size, page);
+    if (size > max_size)
+        size = max_size;
+    reserve = mmap(NULL, max_size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED)
+        return false;
+    if (mprotect(reserve, size, PROT_READ | PROT_WRITE))
+    {
+        munmap(reserve, max_size);
+        return false;
+    }
+    buflib_init(ctx, reserve, size);
+    ctx->reserve = reserve;
+    ctx->reserve_size = max_size;
+    return true;
+}
+
+/* Give back the address space of a context set up by buflib_init_growable(),
+ * its allocations are gone */
+void
+buflib_release(struct buflib_context *ctx)
+{
+    if (ctx->reserve)
+        munmap(ctx->reserve, ctx->reserve_size);
+    ctx->reserve = NULL;
+}
+
+/* Commit more of the reserved address space of a growable context, so that
+ * at least units more are free at the end. The handle table moves to the
+ * new end, handles are counted from there and stay the same. The buffer
+ * grows by half at least, to move the table rarely.
+ *
+ * Returns false if the context isn't growable or the reserve is used up.
+ */
+static bool
+context_grow(struct buflib_context *ctx, size_t units)
+{
+    size_t page = sysconf(_SC_PAGESIZE), committed, size;
+    union buflib_data *end;
+    intptr_t delta;
+    if (!ctx->reserve)
+        return false;
+    committed = (char*)ctx->handle_table - (char*)ctx->reserve;
+    size = units * sizeof(union buflib_data);
+    if (size < committed / 2)
+        size = committed / 2;
+    size = ALIGN_UP(committed + size, page);
+    if (size > ctx->reserve_size)
+        size = ctx->reserve_size;
+    if (size - committed < units * sizeof(union buflib_data)
+            || mprotect((char*)ctx->reserve + committed, size - committed,
+                        PROT_READ | PROT_WRITE))
+        return false;
+    end = (union buflib_data*)((char*)ctx->reserve + size);
+    delta = end - ctx->handle_table;
+    memmove(ctx->last_handle + delta, ctx->last_handle,
+            (ctx->handle_table - ctx->last_handle) * sizeof(union buflib_data));
+    ctx->handle_table = end;
+    ctx->last_handle += delta;
+    if (ctx->first_free_handle)
+        ctx->first_free_handle += delta;
+#ifndef BUFLIB_COMPACT_HEADER
+    /* full headers point to their handle table entry */
+    union buflib_data *block;
+    for (block = ctx->buf_start; block < ctx->alloc_end; block += block_len(block))
+        if (block->val > 0)
+            block[1].handle += delta;
+#endif
+    ctx->stats.grows++;
+    return true;
+}
+
+/* Give the memory of free space of at least min_bytes back to the OS after
+ * frees and compaction, 0 (the default) to keep it. The pages are zeroed
+ * when the space is allocated again, min_bytes is rounded up to them.
+ * Usually what's freed is reused soon, the threshold keeps small frees from
+ * costing system calls and page faults.
+ */
+void
+buflib_set_page_return(struct buflib_context *ctx, size_t min_bytes)
+{
+    buflib_lock(ctx);
+    ctx->page_return_min = min_bytes ?
+                           ALIGN_UP(min_bytes, sysconf(_SC_PAGESIZE)) : 0;
+    buflib_unlock(ctx);
+}
+
+/* Give back the whole pages between start and end, if there's enough */
+static void
+pages_return(struct buflib_context *ctx, void *start, void *end)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *first = (char*)ALIGN_UP((uintptr_t)start, page),
+         *last = (char*)((uintptr_t)end & ~(page - 1));
+    if (last < first || (size_t)(last - first) < ctx->page_return_min)
+        return;
+    if (!madvise(first, last - first, MADV_DONTNEED))
+        ctx->stats.returned_bytes += last - first;
+}
+
+/* Give back the memory of a free block, or of the free space at the end if
+ * block is alloc_end, after freed units of it became free. Nothing is given
+ * back for small frees, even if they add to a big block. The end is given
+ * back only beyond page_return_min bytes, those are likely to be allocated
+ * again first and are kept so that allocating and freeing around the
+ * threshold doesn't go back and forth. The bin links and the boundary tag
+ * of a block are kept.
+ */
+static void
+pages_return_block(struct buflib_context *ctx, union buflib_data *block,
+                   size_t freed)
+{
+    if (!ctx->page_return_min
+            || freed * sizeof(union buflib_data) < ctx->page_return_min)
+        return;
+    if (block == ctx->alloc_end)
+        pages_return(ctx, (char*)block + ctx->page_return_min,
+                     ctx->last_handle);
+    else
+        pages_return(ctx, block + 3, block - block->val - 1);
+}
+#else
+static inline bool
+context_grow(struct buflib_context *ctx, size_t units)
+{
+    (void)ctx;(void)units;
+    return false;
+}
+
+static inline void
+pages_return_block(struct buflib_context *ctx, union buflib_data *block,
+                   size_t freed)
+{
+    (void)ctx;(void)block;(void)freed;
+}
+#endif
+
+#ifdef BUFLIB_HAVE_THREADS
+/* Initialize buffer manager for use by several threads. Every buflib_*
+ * function on this context locks it, and allocations waiting for the lock of
+ * buflib_alloc_maximum() sleep instead of spinning.
+ */
+void
+buflib_init_locked(struct buflib_context *ctx, void *buf, size_t size)
+{
+    pthread_mutexattr_t attr;
+    buflib_init(ctx, buf, size);
+    /* callbacks call back into buflib while the context is locked */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ctx->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&ctx->handle_unlocked, NULL);
+    ctx->threadsafe = true;
+}
+#endif
+
+/* Release the lock of buflib_alloc_maximum() if it's held for handle, and
+ * wake up allocations waiting for it */
+static void
+handle_unlock(struct buflib_context *ctx, int handle)
+{
+    if (ctx->handle_lock != handle)
+        return;
+    ctx->handle_lock = 0;
+#ifdef BUFLIB_HAVE_THREADS
+    if (ctx->threadsafe)
+        pthread_cond_broadcast(&ctx->handle_unlocked);
+#endif
+}
+
+#ifdef BUFLIB_HAVE_TRACE
+static void
+trace_record(struct buflib_context *ctx, uint32_t op, int handle,
+             uint32_t a, uint32_t b)
+{
+    struct buflib_trace_record record = { op, handle, a, b };
+    fwrite(&record, sizeof(record), 1, ctx->trace);
+}
+
+static uint32_t
+trace_alloc_flags(const char *name, struct buflib_callbacks *ops,
+                  unsigned alloc_flags)
+{
+    uint32_t flags = name ? strlen(name) & BUFLIB_TRACE_NAME_MASK : 0;
+    flags |= alloc_flags << BUFLIB_TRACE_ALLOC_FLAGS_SHIFT;
+    if (ops && (ops->move_callback || ops->move_batch_callback))
+        flags |= BUFLIB_TRACE_MOVABLE;
+    if (ops && ops->shrink_callback)
+        flags |= BUFLIB_TRACE_SHRINKABLE;
+    return flags;
+}
+
+/* Record the calls made to ctx to file, until buflib_trace_stop(). The trace
+ * can be replayed with bench_replay.
+ */
+void
+buflib_trace_start(struct buflib_context *ctx, FILE *file)
+{
+    buflib_lock(ctx);
+    ctx->trace = file;
+    trace_record(ctx, BUFLIB_TRACE_INIT, 0,
+                 (char*)ctx->handle_table - (char*)ctx->buf_start, 0);
+    buflib_unlock(ctx);
+}
+
+void
+buflib_trace_stop(struct buflib_context *ctx)
+{
+    buflib_lock(ctx);
+    if (ctx->trace)
+        fflush(ctx->trace);
+    ctx->trace = NULL;
+    buflib_unlock(ctx);
+}
+
+#define TRACE(ctx, op, handle, a, b) \
+    do { if ((ctx)->trace) trace_record(ctx, op, handle, a, b); } while(0)
+#else
+#define TRACE(ctx, op, handle, a, b) do { } while(0)
+#endif
+
+/* Wake up the background compactor if space was freed between allocations
+ * and there's enough of it now */
+static inline void
+compactor_poke(struct buflib_context *ctx)
+{
+#ifdef BUFLIB_HAVE_THREADS
+    struct buflib_compactor *compactor = ctx->compactor;
+    if (compactor && !compactor->pending && !ctx->compact
+        && ctx->free_units*sizeof(union buflib_data) >= compactor->threshold)
+    {
+        compactor->pending = true;
+        pthread_cond_signal(&compactor->wake);
+    }
+#else
+    (void)ctx;
+#endif
+}
+
+/* Entries of the handle table of allocations hold where the data starts
+ * relative to buf_start, so that moving the whole buffer only needs to move
+ * buf_start.
+ */
+static inline char*
+handle_data(struct buflib_context *ctx, union buflib_data *handle)
+{
+    return (char*)ctx->buf_start + handle->val;
+}
+
+static inline void
+handle_set_data(struct buflib_context *ctx, union buflib_data *handle,
+                char *data)
+{
+    handle->val = data - (char*)ctx->buf_start;
+}
+
+/* Free entries of the handle table are threaded into a list starting at
+ * first_free_handle. Each of them holds the complement of the next free
+ * handle, which is 0 if it's the last one. That's always negative, while
+ * the offsets of allocations never are.
+ */
+static inline
+union buflib_data* handle_next_free(struct buflib_context *ctx,
+                                    union buflib_data *handle)
+{
+    if (handle->val == ~(intptr_t)0)
+        return NULL;
+    return ctx->handle_table - ~handle->val;
+}
+
+static inline
+void handle_set_next_free(struct buflib_context *ctx,
+                          union buflib_data *handle, union buflib_data *next)
+{
+    handle->val = ~(intptr_t)(next ? ctx->handle_table - next : 0);
 }
 
 /* Allocate a new handle, returning 0 on failure */
 static inline
 union buflib_data* handle_alloc(struct buflib_context *ctx)
 {
-    union buflib_data *handle;
-    /* first_free_handle is a lower bound on free handles, work through the
-     * table from there until a handle containing NULL is found, or the end
-     * of the table is reached.
-     */
-    for (handle = ctx->first_free_handle; handle >= ctx->last_handle; handle--)
-        if (!handle->alloc)
-            break;
-    /* If the search went past the end of the table, it means we need to extend
-     * the table to get a new handle.
+    union buflib_data *handle = ctx->first_free_handle;
+    /* Take the first entry of the free list. If there is none, we need to
+     * extend the table to get a new handle.
      */
-    if (handle < ctx->last_handle)
-    {
-        if (handle >= ctx->alloc_end)
-            ctx->last_handle--;
-        else
-            return NULL;
-    }
-    handle->val = -1;
+    if (handle)
+        ctx->first_free_handle = handle_next_free(ctx, handle);
+    else if (ctx->last_handle > ctx->alloc_end)
+        handle = --ctx->last_handle;
+    else
+        return NULL;
+    /* 0 marks the entry used until the allocation is set up */
+    handle->val = 0;
     return handle;
 }
 
@@ -126,25 +682,151 @@ union buflib_data* handle_alloc(struct buflib_context *ctx)
 static inline
 void handle_free(struct buflib_context *ctx, union buflib_data *handle)
 {
-    handle->alloc = 0;
-    /* Update free handle lower bound if this handle has a lower index than the
-     * old one.
-     */
-    if (handle > ctx->first_free_handle)
-        ctx->first_free_handle = handle;
     if (handle == ctx->last_handle)
         ctx->last_handle++;
     else
+    {
+        handle_set_next_free(ctx, handle, ctx->first_free_handle);
+        ctx->first_free_handle = handle;
         ctx->compact = false;
+    }
+}
+
+/* Get the start block of an allocation, the header is right in front of the
+ * data (shrinking may have unaligned the data) */
+static inline union buflib_data*
+handle_to_block(struct buflib_context* ctx, int handle)
+{
+    return (union buflib_data*)B_ALIGN_DOWN(buflib_get_data(ctx, handle))
+                                - BUFLIB_HEADER;
 }
 
-/* Get the start block of an allocation */
-static union buflib_data* handle_to_block(struct buflib_context* ctx, int handle)
-{    
-    union buflib_data* name_field =
-                (union buflib_data*)buflib_get_name(ctx, handle);
+static inline bool block_pinned(union buflib_data *block)
+{
+    return (uintptr_t)BUFLIB_BLOCK_INFO(block) >= BUFLIB_PIN_ONE;
+}
+
+#ifdef BUFLIB_COMPACT_HEADER
+/* Find the index of ops in the table of the context, adding them if they're
+ * new. Entries whose allocations are all gone are taken over by new ops,
+ * they're left in place until then so that the ops after them are still
+ * found. Returns -1 if all of the table is used by live allocations. The
+ * entry is counted as used by ops_ref(), once the allocation is set up.
+ */
+static int
+ops_register(struct buflib_context *ctx, struct buflib_callbacks *ops)
+{
+    int i, n, unused = -1;
+    if (!ops || ops == &default_callbacks)
+        return 0;
+    /* 0 is taken by the default callbacks */
+    i = ((uintptr_t)ops / sizeof(void*)) % (BUFLIB_NUM_OPS - 1) + 1;
+    for (n = 1; n < BUFLIB_NUM_OPS; n++)
+    {
+        if (ctx->ops[i] == ops)
+            return i;
+        if (!ctx->ops_refs[i] && unused < 0)
+            unused = i;
+        if (!ctx->ops[i])
+            break;
+        i = i % (BUFLIB_NUM_OPS - 1) + 1;
+    }
+    if (unused >= 0)
+        ctx->ops[unused] = ops;
+    return unused;
+}
 
-    return name_field - 3;
+static inline void
+ops_ref(struct buflib_context *ctx, int ops_index)
+{
+    ctx->ops_refs[ops_index]++;
+}
+
+/* Drop the reference of an allocation that's freed to its ops */
+static inline void
+ops_unref(struct buflib_context *ctx, union buflib_data *block)
+{
+    ctx->ops_refs[block_ops_index(block)]--;
+}
+#else
+static inline void
+ops_unref(struct buflib_context *ctx, union buflib_data *block)
+{
+    (void)ctx;(void)block;
+}
+#endif
+
+/* Find the id of a name, adding it to the names of the context if it's new.
+ * A new name goes into the first run of names without allocations that it
+ * fits in, the rest of the run is left as names that nobody uses. The name
+ * is counted as used by name_ref(), once the allocation is set up.
+ */
+static unsigned
+name_intern(struct buflib_context *ctx, const char *name)
+{
+    struct buflib_names *names = &ctx->names;
+    unsigned recent = ((uintptr_t)name / sizeof(void*)) % BUFLIB_NAME_RECENT;
+    size_t offset, len, size, run = 0, unused = BUFLIB_NAME_SPACE;
+    if (!name)
+        return 0;
+    /* the caller might have reused the memory for another name, and the
+     * space of a name without allocations might have been taken over */
+    if (names->recent[recent] == name
+        && names->refs[names->recent_id[recent] - 1]
+        && !strcmp(names->strings + names->recent_id[recent] - 1, name))
+        return names->recent_id[recent];
+
+    size = strlen(name) + 1;
+    for (offset = 0; offset < names->used; offset += len + 1)
+    {
+        len = strlen(names->strings + offset);
+        if (!strcmp(names->strings + offset, name))
+            break;
+        if (names->refs[offset])
+            run = offset + len + 1;
+        else if (unused == BUFLIB_NAME_SPACE && offset + len + 1 - run >= size)
+            unused = run;
+    }
+    if (offset == names->used)
+    {
+        /* the run at the end can also take the space after used */
+        if (unused == BUFLIB_NAME_SPACE)
+        {
+            if (run + size > BUFLIB_NAME_SPACE)
+                return 0;
+            unused = run;
+        }
+        memcpy(names->strings + unused, name, size);
+        if (unused == run)
+            names->used = run + size;
+        offset = unused;
+    }
+    names->recent[recent] = name;
+    names->recent_id[recent] = offset + 1;
+    return offset + 1;
+}
+
+static inline void
+name_ref(struct buflib_context *ctx, unsigned id)
+{
+    if (id)
+        ctx->names.refs[id - 1]++;
+}
+
+/* Drop the reference of an allocation that's freed to its name */
+static inline void
+name_unref(struct buflib_context *ctx, union buflib_data *block)
+{
+    unsigned id = BUFLIB_BLOCK_INFO(block) & BUFLIB_NAME_ID_MASK;
+    if (id)
+        ctx->names.refs[id - 1]--;
+}
+
+/* Get the name of an id from name_intern(), NULL for none */
+static inline const char*
+name_of(struct buflib_context *ctx, unsigned id)
+{
+    return id ? ctx->names.strings + id - 1 : NULL;
 }
 
 /* Shrink the handle table, returning true if its size was reduced, false if
@@ -154,115 +836,684 @@ static inline
 bool
 handle_table_shrink(struct buflib_context *ctx)
 {
-    bool rv;
     union buflib_data *handle;
-    for (handle = ctx->last_handle; !(handle->alloc); handle++);
-    if (handle > ctx->first_free_handle)
-        ctx->first_free_handle = handle - 1;
-    rv = handle == ctx->last_handle;
-    ctx->last_handle = handle;
-    return rv;
+    for (handle = ctx->last_handle; handle < ctx->handle_table
+                            && buflib_handle_is_free(ctx, handle); handle++);
+    if (handle == ctx->last_handle)
+        return false;
+    /* Some of the free entries are gone, rebuild the list from the remaining
+     * ones so that the lowest handles are handed out first. Links to the
+     * removed entries still need to be seen as free, so last_handle is only
+     * moved afterwards */
+    union buflib_data *new_last_handle = handle;
+    ctx->first_free_handle = NULL;
+    for (; handle < ctx->handle_table; handle++)
+    {
+        if (buflib_handle_is_free(ctx, handle))
+        {
+            handle_set_next_free(ctx, handle, ctx->first_free_handle);
+            ctx->first_free_handle = handle;
+        }
+    }
+    ctx->last_handle = new_last_handle;
+    return true;
+}
+
+/* Owners with a move_batch_callback are asked whether their blocks may be
+ * moved, and told about the moves, a few blocks at a time. Compaction
+ * collects the next batch whenever it gets to the end of the current one.
+ */
+#define BUFLIB_MOVE_BATCH 16
+/* how many blocks to look at for a batch at most, to bound the time spent
+ * ahead of compaction steps */
+#define BUFLIB_MOVE_BATCH_SCAN 64
+
+struct move_batch
+{
+    struct buflib_move moves[BUFLIB_MOVE_BATCH];
+    struct buflib_callbacks *ops[BUFLIB_MOVE_BATCH];
+    bool vetoed[BUFLIB_MOVE_BATCH];
+    int count;
+    /* the first block not covered by this batch */
+    union buflib_data *end;
+};
+
+/* Collect the blocks with batch owners from block on, sorted by owner, and
+ * ask each owner whether its blocks may be moved */
+static void
+batch_prepare(struct buflib_context *ctx, struct move_batch *batch,
+              union buflib_data *block)
+{
+    int i, j, scanned = 0;
+    batch->count = 0;
+    for (; block < ctx->alloc_end && batch->count < BUFLIB_MOVE_BATCH
+           && scanned < BUFLIB_MOVE_BATCH_SCAN; block += block_len(block))
+    {
+        struct buflib_callbacks *ops;
+        scanned++;
+        if (block->val < 0)
+            continue;
+        ops = block_ops(ctx, block);
+        if (!ops->move_batch_callback || block_pinned(block))
+            continue;
+        /* insertion sort keeps the address order within each owner */
+        for (i = batch->count++; i > 0
+                && (uintptr_t)batch->ops[i-1] > (uintptr_t)ops; i--)
+        {
+            batch->moves[i] = batch->moves[i-1];
+            batch->ops[i] = batch->ops[i-1];
+        }
+        batch->moves[i].handle = ctx->handle_table - block_handle(ctx, block);
+        batch->moves[i].old = handle_data(ctx, block_handle(ctx, block));
+        batch->moves[i].new = NULL;
+        batch->ops[i] = ops;
+        batch->vetoed[i] = false;
+    }
+    batch->end = block;
+    for (i = 0; i < batch->count; i = j)
+    {
+        for (j = i + 1; j < batch->count && batch->ops[j] == batch->ops[i]; j++);
+        if (batch->ops[i]->move_batch_callback(BUFLIB_MOVE_PREPARE,
+                                &batch->moves[i], j - i) == BUFLIB_CB_CANNOT_MOVE)
+            memset(&batch->vetoed[i], true, j - i);
+    }
 }
 
+/* Tell each owner about the blocks of the batch that were actually moved */
+static void
+batch_finish(struct move_batch *batch)
+{
+    int i, j, moved;
+    for (i = 0; i < batch->count; i = j)
+    {
+        /* gather the moved blocks of this owner at the front */
+        moved = i;
+        for (j = i; j < batch->count && batch->ops[j] == batch->ops[i]; j++)
+            if (batch->moves[j].new)
+                batch->moves[moved++] = batch->moves[j];
+        if (moved > i)
+            batch->ops[i]->move_batch_callback(BUFLIB_MOVE_DONE,
+                                               &batch->moves[i], moved - i);
+    }
+    batch->count = 0;
+}
+
+/* Check whether block can be moved by shift, and tell its owner where it's
+ * going to be. Returns the new start of the allocation, or NULL if moving is
+ * unsucessful (NULL callback or BUFLIB_CB_CANNOT_MOVE was returned, the
+ * owner vetoed moving the batch of the block, or the block is pinned)
+ */
+static char*
+move_prepare(struct buflib_context* ctx, union buflib_data* block, int shift,
+             struct move_batch *batch)
+{
+    char* new_start;
+    union buflib_data *tmp = block_handle(ctx, block);
+    struct buflib_callbacks *ops = block_ops(ctx, block);
+    struct buflib_move *batched = NULL;
+    int handle = ctx->handle_table - tmp;
+
+    if (block_pinned(block))
+        return NULL;
+    if (ops && ops->move_batch_callback)
+    {
+        int i;
+        for (i = 0; i < batch->count; i++)
+            if (batch->moves[i].handle == handle)
+                break;
+        if (i == batch->count || batch->vetoed[i])
+            return NULL;
+        batched = &batch->moves[i];
+    }
+    else if (ops && !ops->move_callback)
+        return NULL;
+
+    BDEBUGF("%s(): moving \"%s\"(id=%d) by %d(%d)\n", __func__,
+            name_of(ctx, BUFLIB_BLOCK_INFO(block) & BUFLIB_NAME_ID_MASK),
+            handle, shift, shift*sizeof(union buflib_data));
+    new_start = handle_data(ctx, tmp) + shift*sizeof(union buflib_data);
+    /* call the callback before moving, the default one needn't be called.
+     * Batch owners are told after the whole batch was moved */
+    if (batched)
+        batched->new = new_start;
+    else if (ops)
+    {
+        if (ops->move_callback(handle, handle_data(ctx, tmp), new_start)
+                == BUFLIB_CB_CANNOT_MOVE)
+            return NULL;
+    }
+    return new_start;
+}
 
 /* If shift is non-zero, it represents the number of places to move
  * blocks in memory. Calculate the new address for this block,
  * update its entry in the handle table, and then move its contents.
  *
- * Returns false if moving was unsucessful
- * (NULL callback or BUFLIB_CB_CANNOT_MOVE was returned)
+ * Returns false if moving was unsucessful, see move_prepare()
  */
 static bool
-move_block(struct buflib_context* ctx, union buflib_data* block, int shift)
+move_block(struct buflib_context* ctx, union buflib_data* block, int shift,
+           struct move_batch *batch)
 {
-    char* new_start;
-    union buflib_data *new_block, *tmp = block[1].handle;
-    struct buflib_callbacks *ops = block[2].ops;
-    if (ops && !ops->move_callback)
+    char* new_start = move_prepare(ctx, block, shift, batch);
+    if (!new_start)
         return false;
-        
-    int handle = ctx->handle_table - tmp;
-    BDEBUGF("%s(): moving \"%s\"(id=%d) by %d(%d)\n", __func__, block[3].name,
-            handle, shift, shift*sizeof(union buflib_data));
-    new_block = block + shift;
-    new_start = tmp->alloc + shift*sizeof(union buflib_data);
-    /* call the callback before moving, the default one needn't be called */
-    if (ops)
+    /* update handle table */
+    handle_set_data(ctx, block_handle(ctx, block), new_start);
+    buflib_move_data(block + shift, block, block->val * sizeof(union buflib_data));
+    ctx->stats.moved_bytes += block->val * sizeof(union buflib_data);
+
+    return true;
+}
+
+/* Move the adjacent blocks from run up to end by shift with a single
+ * memmove, after move_prepare() was called for each of them. Until then
+ * their handles still point to the old place, where the data still is.
+ */
+static void
+move_run(struct buflib_context *ctx, union buflib_data *run,
+         union buflib_data *end, int shift)
+{
+    union buflib_data *block;
+    for (block = run; block < end; block += block->val)
+        block_handle(ctx, block)->val += shift*sizeof(union buflib_data);
+    buflib_move_data(run + shift, run, (end - run) * sizeof(union buflib_data));
+    ctx->stats.moved_bytes += (end - run) * sizeof(union buflib_data);
+}
+
+/* An incremental compaction pass resumes at compact_cursor. Free blocks that
+ * get merged across it must move it to their start, it would point into the
+ * middle of a block otherwise.
+ */
+static inline void
+compact_cursor_merged(struct buflib_context *ctx, union buflib_data *block,
+                      union buflib_data *end)
+{
+    if (ctx->compact_cursor > block && ctx->compact_cursor < end)
+        ctx->compact_cursor = block;
+}
+
+/* The fixed zone mustn't end within a free block, free space that reaches
+ * its end is taken out of it */
+static inline void
+fixed_trim(struct buflib_context *ctx, union buflib_data *start,
+           union buflib_data *end)
+{
+    if (start < ctx->fixed_end && ctx->fixed_end <= end)
+        ctx->fixed_end = start;
+}
+
+/* Mark an allocated block as free, merging it with free neighbours. Returns
+ * the free block it ended up in, alloc_end if that's the free space at the
+ * end */
+static union buflib_data*
+free_block(struct buflib_context *ctx, union buflib_data *block)
+{
+    union buflib_data *next_block = block + block->val;
+    intptr_t len = block->val;
+    /* If the block before this one is free, its boundary tag gives its
+     * length, and we can combine them.
+     */
+    if (block_prev_free(block))
     {
-        if (ops->move_callback(handle, tmp->alloc, new_start)
-                == BUFLIB_CB_CANNOT_MOVE)
-            return false;
+        block += block[-1].val;
+        free_remove(ctx, block);
+        len -= block->val;
+    }
+    /* Check if we are merging with the free space at alloc_end. */
+    if (next_block == ctx->alloc_end)
+    {
+        ctx->alloc_end = block;
+        compact_cursor_merged(ctx, block, ctx->handle_table);
+        fixed_trim(ctx, block, ctx->handle_table);
     }
-    tmp->alloc = new_start; /* update handle table */
-    memmove(new_block, block, block->val * sizeof(union buflib_data));
+    /* Otherwise, the next block might still be a "normal" free block, and the
+     * mid-allocation free means that the buffer is no longer compact.
+     */
+    else {
+        ctx->compact = false;
+        if (next_block->val < 0)
+        {
+            free_remove(ctx, next_block);
+            len -= next_block->val;
+        }
+        else
+            block_set_prev_free(next_block, true);
+        mark_free(block, len);
+        free_insert(ctx, block);
+        compact_cursor_merged(ctx, block, block + len);
+        fixed_trim(ctx, block, block + len);
+    }
+    /* If this block is before first_free_block, it becomes the new starting
+     * point for free-block search.
+     */
+    if (block < ctx->first_free_block)
+        ctx->first_free_block = block;
+    return block;
+}
 
-    return true;
+/* How many blocks behind an unmovable one are looked at for packing the
+ * hole in front of it */
+#define BUFLIB_PACK_SCAN 16
+
+/* Fill the space from hole up to the unmovable block island with blocks from
+ * behind the island, each time moving the biggest one that fits, so that as
+ * little as possible is left over. Blocks of batch owners aren't considered,
+ * they're only moved with their batch. The space the blocks leave is freed,
+ * compaction picks it up when it gets there. Blocks are only moved while
+ * moved stays within max_bytes (no limit if 0), it's increased accordingly.
+ *
+ * Returns where the space left over in front of island starts.
+ */
+static union buflib_data*
+pack_hole(struct buflib_context *ctx, union buflib_data *hole,
+          union buflib_data *island, size_t max_bytes, size_t *moved)
+{
+    union buflib_data *block, *best;
+    struct move_batch batch;
+    struct buflib_callbacks *ops;
+    intptr_t room;
+    int scanned;
+    batch.count = 0;
+    while ((room = island - hole) >= BUFLIB_HEADER)
+    {
+        best = NULL;
+        scanned = 0;
+        for (block = island + island->val; block < ctx->alloc_end
+                && scanned < BUFLIB_PACK_SCAN; block += block_len(block))
+        {
+            scanned++;
+            if (block->val < 0 || block->val > room
+                    || (best && block->val <= best->val)
+                    || (max_bytes && *moved + block->val
+                            * sizeof(union buflib_data) > max_bytes)
+                    || block_pinned(block))
+                continue;
+            ops = block_ops(ctx, block);
+            if (ops->move_callback && !ops->move_batch_callback)
+                best = block;
+        }
+        if (!best || !move_block(ctx, best, hole - best, &batch))
+            break;
+        *moved += best->val * sizeof(union buflib_data);
+        block_set_prev_free(hole, false);
+        hole += best->val;
+        /* the header is still intact at the old place */
+        free_block(ctx, best);
+    }
+    return hole;
 }
 
-/* Compact allocations and handle table, adjusting handle pointers as needed.
- * Return true if any space was freed or consolidated, false otherwise.
+/* Slide allocations down, starting at start, until either alloc_end is
+ * reached or max_bytes have been moved (no limit if 0). A single block bigger
+ * than max_bytes is still moved to guarantee progress. If the limit is hit,
+ * the space gathered so far is left as a free block and compact_cursor
+ * records where to resume. The complete argument tells whether this pass
+ * covers every free block, allowing first_free_block to be raised.
+ *
+ * Return true if space was freed at alloc_end, false otherwise.
  */
 static bool
-buflib_compact(struct buflib_context *ctx)
+compact_blocks(struct buflib_context *ctx, union buflib_data *start,
+               size_t max_bytes, bool complete)
 {
-    BDEBUGF("%s(): Compacting!\n", __func__);
-    union buflib_data *first_free = ctx->first_free_block, *block;
+    union buflib_data *block, *hole, *first_hole = NULL, *run = NULL;
     int shift = 0, len;
-    /* Store the results of attempting to shrink the handle table */
-    bool ret = handle_table_shrink(ctx);
-    for(block = first_free; block != ctx->alloc_end; block += len)
+    size_t moved = 0;
+    struct move_batch batch;
+    bool holes_before;
+    /* blocks may have been freed in front of where a previous step stopped,
+     * include them so that the space they free is gathered as well */
+    if (start < ctx->alloc_end && start->val > 0 && block_prev_free(start))
+        start += start[-1].val;
+    /* there are no holes to fill unless there are free blocks in front of
+     * start, or this pass leaves some behind */
+    holes_before = ctx->first_free_block < start;
+    batch.count = 0;
+    batch.end = start;
+    ctx->stats.compactions++;
+    for(block = start; block < ctx->alloc_end; block += len)
     {
         len = block->val;
+        /* blocks that are slid down by the same shift one after another are
+         * collected into a run and moved together, anything else moves the
+         * run first */
+        if (run && (len < 0 || block >= batch.end))
+        {
+            move_run(ctx, run, block, shift);
+            run = NULL;
+        }
+        if (block >= batch.end)
+        {
+            batch_finish(&batch);
+            batch_prepare(ctx, &batch, block);
+        }
         /* This block is free, add its length to the shift value */
         if (len < 0)
         {
+            free_remove(ctx, block);
             shift += len;
             len = -len;
             continue;
         }
-        /* attempt to fill any hole */
-        if (abs(ctx->first_free_block->val) > block->val)
+        /* look for a hole left behind by unmovable blocks to fill. Holes of
+         * the fixed zone are kept for fixed allocations */
+        hole = NULL;
+        if (holes_before || first_hole)
+            hole = free_find_in(ctx, len, ctx->fixed_end, block);
+        if (!hole && !shift)
+            continue;
+        if (max_bytes && moved
+                && moved + len*sizeof(union buflib_data) > max_bytes)
+        {   /* out of budget, leave the gathered space as a free block and
+             * resume from there */
+            if (run)
+                move_run(ctx, run, block, shift);
+            if (shift)
+            {
+                block_set_prev_free(block, true);
+                block += shift;
+                mark_free(block, -shift);
+                free_insert(ctx, block);
+            }
+            ctx->compact_cursor = block;
+            if (first_hole && first_hole < block)
+                block = first_hole;
+            if (block < ctx->first_free_block)
+                ctx->first_free_block = block;
+            batch_finish(&batch);
+            return false;
+        }
+        moved += len*sizeof(union buflib_data);
+        /* attempt to fill the hole, the space of this block then adds to
+         * the shift value */
+        if (hole)
         {
-            intptr_t size = first_free->val;
-            if (move_block(ctx, block, first_free - block))
+            intptr_t hole_len = -hole->val;
+            if (run)
+            {
+                move_run(ctx, run, block, shift);
+                run = NULL;
+            }
+            free_remove(ctx, hole);
+            if (move_block(ctx, block, hole - block, &batch))
             {
-                block->val *= -1;
-                block = ctx->first_free_block;
-                ctx->first_free_block += block->val;
-                ctx->first_free_block->val = size + block->val;
+                block_set_prev_free(hole, false);
+                if (hole_len > len)
+                {
+                    union buflib_data *rest = hole + len;
+                    mark_free(rest, hole_len - len);
+                    free_insert(ctx, rest);
+                    if (!first_hole || rest < first_hole)
+                        first_hole = rest;
+                }
+                else
+                    block_set_prev_free(hole + hole_len, false);
+                shift -= len;
                 continue;
             }
+            free_insert(ctx, hole);
         }
-        /* attempt move the allocation by shift */
+        /* attempt move the allocation by shift, the block is still in place
+         * until its run is moved */
         if (shift)
         {
-            /* failing to move creates a hole, therefore mark this
-             * block as not allocated anymore and move first_free_block up */
-            if (!move_block(ctx, block, shift))
+            if (move_prepare(ctx, block, shift, &batch))
             {
-                union buflib_data* hole = block + shift;
-                hole->val = shift;
-                if (ctx->first_free_block > hole)
-                    ctx->first_free_block = hole;
+                block_set_prev_free(block, false);
+                if (!run)
+                    run = block;
+            }
+            /* failing to move creates a hole in front of the block, pack
+             * blocks from behind it into the hole, and mark what's left as
+             * not allocated anymore and move first_free_block up */
+            else
+            {
+                if (run)
+                {
+                    move_run(ctx, run, block, shift);
+                    run = NULL;
+                }
+                hole = pack_hole(ctx, block + shift, block, max_bytes, &moved);
+                if (hole < block)
+                {
+                    mark_free(hole, block - hole);
+                    free_insert(ctx, hole);
+                    if (!first_hole || hole < first_hole)
+                        first_hole = hole;
+                }
+                block_set_prev_free(block, hole < block);
                 shift = 0;
             }
         }
     }
-    /* Move the end-of-allocation mark, and return true if any new space has
-     * been freed.
-     */
+    if (run)
+        move_run(ctx, run, block, shift);
+    batch_finish(&batch);
+    /* Move the end-of-allocation mark */
     ctx->alloc_end += shift;
-    /* only move first_free_block up if it wasn't already by a hole */
-    if (ctx->first_free_block > ctx->alloc_end)
+    if (complete)
+        /* holes are the only free blocks left */
+        ctx->first_free_block = first_hole ?: ctx->alloc_end;
+    else if (first_hole && first_hole < ctx->first_free_block)
+        ctx->first_free_block = first_hole;
+    else if (ctx->first_free_block > ctx->alloc_end)
         ctx->first_free_block = ctx->alloc_end;
+    ctx->compact_cursor = NULL;
     ctx->compact = true;
-    return ret || shift;
+    return shift;
+}
+
+/* Compact allocations and handle table, adjusting handle pointers as needed.
+ * Return true if any space was freed or consolidated, false otherwise.
+ */
+static bool
+buflib_compact(struct buflib_context *ctx)
+{
+    BDEBUGF("%s(): Compacting!\n", __func__);
+    /* Store the results of attempting to shrink the handle table */
+    bool ret = handle_table_shrink(ctx);
+    /* an incremental pass in progress is superseded by this one. The fixed
+     * zone is left alone, its holes are kept for fixed allocations */
+    if (ctx->first_free_block >= ctx->fixed_end)
+        return compact_blocks(ctx, ctx->first_free_block, 0, true) || ret;
+    return compact_blocks(ctx, ctx->fixed_end, 0, false) || ret;
 }
 
+/* Compact allocations incrementally, moving at most max_bytes per call
+ * (0 for no limit). A new pass is started if none is in progress, and picked up where the
+ * previous call left it otherwise. Allocations, frees and shrinks can
+ * happen between the steps.
+ *
+ * Returns true once the buffer is compact, false if more steps are needed.
+ */
+bool
+buflib_compact_step(struct buflib_context *ctx, size_t max_bytes)
+{
+    buflib_lock(ctx);
+    union buflib_data *start = ctx->compact_cursor;
+    bool complete = !start;
+    if (!start && !ctx->compact)
+    {
+        BDEBUGF("%s(): Compacting!\n", __func__);
+        handle_table_shrink(ctx);
+        start = ctx->first_free_block;
+    }
+    if (start && start < ctx->fixed_end)
+    {
+        start = ctx->fixed_end;
+        complete = false;
+    }
+    if (start)
+        compact_blocks(ctx, start, max_bytes, complete);
+    complete = !ctx->compact_cursor;
+    /* what a finished pass gathered at the end may not be needed soon */
+    if (start && complete)
+        pages_return_block(ctx, ctx->alloc_end,
+                           ctx->last_handle - ctx->alloc_end);
+    buflib_unlock(ctx);
+    return complete;
+}
+
+/* Return how many bytes are free between allocations, i.e. how much space
+ * compaction would gather at the end of the buffer */
+size_t
+buflib_fragmented(struct buflib_context *ctx)
+{
+    buflib_lock(ctx);
+    size_t free_units = ctx->free_units;
+    buflib_unlock(ctx);
+    return free_units * sizeof(union buflib_data);
+}
+
+#ifdef BUFLIB_HAVE_VM
+/* Return how many bytes of the buffer are resident, as the OS sees it. The
+ * OS is asked about every page of the buffer, which takes a system call per
+ * 256 pages, so this isn't part of buflib_get_stats(). The context isn't
+ * locked meanwhile, the result may be outdated by other threads.
+ */
+size_t
+buflib_resident(struct buflib_context *ctx)
+{
+    size_t page = sysconf(_SC_PAGESIZE), resident = 0, i, n;
+    unsigned char pages[256];
+    char *start, *end;
+    buflib_lock(ctx);
+    start = (char*)((uintptr_t)ctx->buf_start & ~(page - 1));
+    end = (char*)ctx->handle_table;
+    buflib_unlock(ctx);
+    for (; start < end; start += n * page)
+    {
+        n = (end - start + page - 1) / page;
+        if (n > sizeof(pages))
+            n = sizeof(pages);
+        if (mincore(start, n * page, pages))
+            break;
+        for (i = 0; i < n; i++)
+            if (pages[i] & 1)
+                resident += page;
+    }
+    return resident;
+}
+#endif
+
+/* Fill in stats. The counters are kept up to date by the allocator, the
+ * sizes are derived from what it keeps track of anyway, only finding the
+ * largest free block needs to look at the free blocks of the biggest size
+ * class.
+ */
+void
+buflib_get_stats(struct buflib_context *ctx, struct buflib_stats *stats)
+{
+    union buflib_data *block;
+    size_t largest;
+    buflib_lock(ctx);
+    *stats = ctx->stats;
+    stats->live_bytes = (ctx->alloc_end - ctx->buf_start - ctx->free_units)
+                        * sizeof(union buflib_data);
+    largest = ctx->last_handle - ctx->alloc_end;
+    stats->free_bytes = (ctx->free_units + largest)
+                        * sizeof(union buflib_data);
+    if (ctx->free_bins_map)
+    {
+        int bin = 31 - __builtin_clz(ctx->free_bins_map);
+        for (block = ctx->free_bins[bin]; block; block = block[1].handle)
+            if ((size_t)-block->val > largest)
+                largest = -block->val;
+    }
+    stats->largest_free = largest * sizeof(union buflib_data);
+#ifdef BUFLIB_HAVE_VM
+    stats->reserved_bytes = ctx->reserve ? ctx->reserve_size
+                    : (size_t)((char*)ctx->handle_table - (char*)ctx->buf_start);
+#endif
+    buflib_unlock(ctx);
+}
+
+#ifdef BUFLIB_HAVE_THREADS
+static void*
+compactor_thread(void *arg)
+{
+    struct buflib_compactor *compactor = arg;
+    struct buflib_context *ctx = compactor->ctx;
+    pthread_mutex_lock(&ctx->mutex);
+    while (!compactor->stop)
+    {
+        if (!compactor->pending)
+        {
+            pthread_cond_wait(&compactor->wake, &ctx->mutex);
+            continue;
+        }
+        compactor->pending = false;
+        /* give up the lock between the steps, allocations go first */
+        bool done;
+        do {
+            pthread_mutex_unlock(&ctx->mutex);
+            done = buflib_compact_step(ctx, compactor->step);
+            YIELD();
+            pthread_mutex_lock(&ctx->mutex);
+        } while (!done && !compactor->stop);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return NULL;
+}
+
+/* Start a thread that compacts ctx, which must be initialized with
+ * buflib_init_locked(), whenever frees leave at least threshold bytes between
+ * allocations. It moves up to step bytes at a time (0 for no limit) and lets
+ * other threads in between, so allocating threads rarely need to compact
+ * themselves. Allocations may move at any time then, their data must only be
+ * accessed with the context locked or while pinned.
+ *
+ * Returns false if the thread couldn't be started.
+ */
+bool
+buflib_compactor_start(struct buflib_compactor *compactor,
+                       struct buflib_context *ctx,
+                       size_t threshold, size_t step)
+{
+    if (!ctx->threadsafe || ctx->compactor)
+        return false;
+    compactor->ctx = ctx;
+    compactor->threshold = threshold;
+    compactor->step = step;
+    compactor->pending = false;
+    compactor->stop = false;
+    pthread_cond_init(&compactor->wake, NULL);
+    buflib_lock(ctx);
+    if (pthread_create(&compactor->thread, NULL, compactor_thread, compactor))
+    {
+        buflib_unlock(ctx);
+        pthread_cond_destroy(&compactor->wake);
+        return false;
+    }
+    ctx->compactor = compactor;
+    /* catch up with frees from before */
+    compactor_poke(ctx);
+    buflib_unlock(ctx);
+    return true;
+}
+
+/* Stop the compactor thread and wait for it to finish */
+void
+buflib_compactor_stop(struct buflib_compactor *compactor)
+{
+    struct buflib_context *ctx = compactor->ctx;
+    buflib_lock(ctx);
+    ctx->compactor = NULL;
+    compactor->stop = true;
+    pthread_cond_signal(&compactor->wake);
+    buflib_unlock(ctx);
+    pthread_join(compactor->thread, NULL);
+    pthread_cond_destroy(&compactor->wake);
+}
+#endif
+
 /* Compact the buffer by trying both shrinking and moving.
  *
  * Try to move first. If unsuccesfull, try to shrink. If that was successful
- * try to move once more as there might be more room now.
+ * try to move once more as there might be more room now. Shrinkable
+ * allocations are asked in the order of their shrink_cost, and only until
+ * as much as the size in shrink_hints was freed.
  */
 static bool
 buflib_compact_and_shrink(struct buflib_context *ctx, unsigned shrink_hints)
@@ -274,22 +1525,52 @@ buflib_compact_and_shrink(struct buflib_context *ctx, unsigned shrink_hints)
     if (!result)
     {
         union buflib_data* this;
-        for(this = ctx->buf_start; this < ctx->alloc_end; this += abs(this->val))
-        {
-            if (this->val > 0 && this[2].ops
-                              && this[2].ops->shrink_callback)
+        /* stop asking once as much as the allocation needs was given up */
+        size_t wanted = (shrink_hints & BUFLIB_SHRINK_SIZE_MASK)
+                            / sizeof(union buflib_data);
+        size_t had_free = ctx->free_units + (ctx->last_handle - ctx->alloc_end);
+        unsigned cost = 0, next_cost;
+        bool more;
+        /* cheaper owners first, one pass over the buffer per cost */
+        do {
+            more = false;
+            next_cost = UINT_MAX;
+            for(this = ctx->buf_start; this < ctx->alloc_end; this += block_len(this))
             {
+                struct buflib_callbacks *ops;
+                if (this->val < 0)
+                    continue;
+                ops = block_ops(ctx, this);
+                if (!ops->shrink_callback || block_pinned(this))
+                    continue;
+                if (ops->shrink_cost != cost)
+                {
+                    if (ops->shrink_cost > cost && ops->shrink_cost <= next_cost)
+                    {
+                        next_cost = ops->shrink_cost;
+                        more = true;
+                    }
+                    continue;
+                }
                 int ret;
-                int handle = ctx->handle_table - this[1].handle;
-                char* data = this[1].handle->alloc;
-                ret = this[2].ops->shrink_callback(handle, shrink_hints,
+                int handle = ctx->handle_table - block_handle(ctx, this);
+                char* data = handle_data(ctx, block_handle(ctx, this));
+                ret = ops->shrink_callback(handle, shrink_hints,
                                             data, (char*)(this+this->val)-data);
+                ctx->stats.shrink_calls++;
+                if (ret == BUFLIB_CB_OK)
+                    ctx->stats.shrinks_ok++;
                 result |= (ret == BUFLIB_CB_OK);
+                if (ctx->free_units + (ctx->last_handle - ctx->alloc_end)
+                        >= had_free + wanted)
+                    goto done;
                 /* this might have changed in the callback (if
                  * it shrinked from the top), get it again */
                 this = handle_to_block(ctx, handle);
             }
-        }
+            cost = next_cost;
+        } while (more);
+done:
         /* shrinking was successful at least once, try compaction again */
         if (result)
             result |= buflib_compact(ctx);
@@ -298,19 +1579,34 @@ buflib_compact_and_shrink(struct buflib_context *ctx, unsigned shrink_hints)
     return result;
 }
 
-/* Shift buffered items by size units, and update handle pointers. The shift
- * value must be determined to be safe *before* calling.
+/* Shift buffered items by size units, and update the pointers into them. The
+ * shift value must be determined to be safe *before* calling.
  */
 static void
 buflib_buffer_shift(struct buflib_context *ctx, int shift)
 {
-    memmove(ctx->buf_start + shift, ctx->buf_start,
+    buflib_move_data(ctx->buf_start + shift, ctx->buf_start,
         (ctx->alloc_end - ctx->buf_start) * sizeof(union buflib_data));
-    union buflib_data *handle;
-    for (handle = ctx->last_handle; handle < ctx->handle_table; handle++)
-        if (handle->alloc)
-            handle->alloc += shift;
+    /* the handles are relative to buf_start and needn't change, but the free
+     * lists link the moved blocks by address */
+    for (int bin = 0; bin < BUFLIB_NUM_BINS; bin++)
+    {
+        union buflib_data *block;
+        if (!ctx->free_bins[bin])
+            continue;
+        ctx->free_bins[bin] += shift;
+        for (block = ctx->free_bins[bin]; block; block = block[1].handle)
+        {
+            if (block[1].handle)
+                block[1].handle += shift;
+            if (block[2].handle)
+                block[2].handle += shift;
+        }
+    }
     ctx->first_free_block += shift;
+    ctx->fixed_end += shift;
+    if (ctx->compact_cursor)
+        ctx->compact_cursor += shift;
     ctx->buf_start += shift;
     ctx->alloc_end += shift;
 }
@@ -321,9 +1617,13 @@ buflib_buffer_shift(struct buflib_context *ctx, int shift)
 void*
 buflib_buffer_out(struct buflib_context *ctx, size_t *size)
 {
+    buflib_lock(ctx);
     if (!ctx->compact)
         buflib_compact(ctx);
     size_t avail = ctx->last_handle - ctx->alloc_end;
+    /* pinned allocations must not be shifted */
+    if (ctx->pinned)
+        avail = 0;
     size_t avail_b = avail * sizeof(union buflib_data);
     if (*size && *size < avail_b)
     {
@@ -331,18 +1631,112 @@ buflib_buffer_out(struct buflib_context *ctx, size_t *size)
             / sizeof(union buflib_data);
         avail_b = avail * sizeof(union buflib_data);
     }
+    TRACE(ctx, BUFLIB_TRACE_BUFFER_OUT, 0, *size, avail_b);
     *size = avail_b;
     void *ret = ctx->buf_start;
     buflib_buffer_shift(ctx, avail);
+    buflib_unlock(ctx);
     return ret;
 }
 
-/* Shift buffered items down by size bytes */
+/* Shift buffered items down by size bytes, nothing may be pinned since
+ * buflib_buffer_out() */
 void
 buflib_buffer_in(struct buflib_context *ctx, int size)
 {
+    buflib_lock(ctx);
+    TRACE(ctx, BUFLIB_TRACE_BUFFER_IN, 0, size, 0);
     size /= sizeof(union buflib_data);
     buflib_buffer_shift(ctx, -size);
+    buflib_unlock(ctx);
+}
+
+/* Move the allocated block out of the way of a fixed allocation that is to
+ * end at end, into a free block after end or to alloc_end. Returns false if
+ * the block can't be moved.
+ */
+static bool
+evacuate(struct buflib_context *ctx, union buflib_data *block,
+         union buflib_data *end, struct move_batch *batch)
+{
+    intptr_t len = block->val, dest_len = 0;
+    union buflib_data *dest = free_find_in(ctx, len, end, ctx->alloc_end);
+    if (dest)
+    {
+        dest_len = -dest->val;
+        free_remove(ctx, dest);
+    }
+    else
+    {
+        dest = ctx->alloc_end > end ? ctx->alloc_end : end;
+        if (dest + len > ctx->last_handle)
+            return false;
+    }
+    if (!move_block(ctx, block, dest - block, batch))
+    {
+        if (dest_len)
+            free_insert(ctx, dest);
+        return false;
+    }
+    if (dest_len)
+    {   /* into a free block, what's left of it stays free */
+        block_set_prev_free(dest, false);
+        if (dest_len > len)
+        {
+            mark_free(dest + len, dest_len - len);
+            free_insert(ctx, dest + len);
+        }
+        else
+            block_set_prev_free(dest + len, false);
+    }
+    else
+    {   /* to alloc_end, skipping what's left of the fixed allocation's space */
+        block_set_prev_free(dest, dest > ctx->alloc_end);
+        if (dest > ctx->alloc_end)
+        {
+            mark_free(ctx->alloc_end, dest - ctx->alloc_end);
+            free_insert(ctx, ctx->alloc_end);
+        }
+        ctx->alloc_end = dest + len;
+    }
+    /* the header is still intact at the old place */
+    free_block(ctx, block);
+    return true;
+}
+
+/* Find room for a fixed allocation of size units: a hole in the fixed zone,
+ * or the space after it, which movable allocations are moved out of if
+ * needed. Returns NULL if there's no room, the allocation is placed like a
+ * movable one then.
+ */
+static union buflib_data*
+fixed_find(struct buflib_context *ctx, size_t size)
+{
+    union buflib_data *block, *at, *end;
+    struct move_batch batch;
+    block = free_find_in(ctx, size, ctx->buf_start, ctx->fixed_end);
+    if (block)
+        return block;
+    /* don't move anything if there's not enough space anyway */
+    if ((size_t)(ctx->last_handle - ctx->alloc_end) + ctx->free_units < size)
+        return NULL;
+    /* batch owners aren't asked, they're left in place */
+    batch.count = 0;
+    for (;;)
+    {
+        at = ctx->fixed_end;
+        end = at + size;
+        for (block = at; block < end && block < ctx->alloc_end
+                         && block->val < 0; block -= block->val);
+        /* free blocks are never adjacent, at is a single free block of at
+         * least size units or alloc_end */
+        if (block >= end)
+            return at;
+        if (block == ctx->alloc_end)
+            return ctx->last_handle >= end ? at : NULL;
+        if (!evacuate(ctx, block, end, &batch))
+            return NULL;
+    }
 }
 
 /* Allocate a buffer of size bytes, returning a handle for it */
@@ -359,28 +1753,36 @@ buflib_alloc(struct buflib_context *ctx, size_t size)
  * shrinking. NULL for default callbacks
  */
 
-int
-buflib_alloc_ex(struct buflib_context *ctx, size_t size, const char *name,
-                struct buflib_callbacks *ops)
+static int
+alloc_ex_unlocked(struct buflib_context *ctx, size_t size, const char *name,
+                  struct buflib_callbacks *ops, unsigned flags)
 {
-    /* busy wait if there's a thread owning the lock */
-    while (ctx->handle_lock != 0) YIELD();
-
     union buflib_data *handle, *block;
-    size_t name_len = name ? B_ALIGN_UP(strlen(name)+1) : 0;
     bool last;
+    unsigned name_id;
     /* This really is assigned a value before use */
     int block_len;
-    size += name_len;
     size = (size + sizeof(union buflib_data) - 1) /
            sizeof(union buflib_data)
-           /* add 4 objects for alloc len, pointer to handle table entry and
-            * name length, and the ops pointer */
-           + 4;
+           /* add the header: alloc len, handle table entry, ops and name id */
+           + BUFLIB_HEADER;
+#ifdef BUFLIB_COMPACT_HEADER
+    int ops_index = ops_register(ctx, ops);
+    /* with the table full, the allocation gets the default callbacks, which
+     * are never called, and is kept in place like an unmovable one */
+    if (ops_index < 0)
+    {
+        ops_index = 0;
+        flags |= BUFLIB_ALLOC_UNMOVABLE;
+    }
+#endif
 handle_alloc:
     handle = handle_alloc(ctx);
     if (!handle)
     {
+        /* A growable context grows, with room for the allocation as well */
+        if (context_grow(ctx, size + 1))
+            goto handle_alloc;
         /* If allocation has failed, and compaction has succeded, it may be
          * possible to get a handle by trying again.
          */
@@ -391,26 +1793,51 @@ handle_alloc:
              * to make room for new handles */
             int handle = ctx->handle_table - ctx->last_handle;
             union buflib_data* last_block = handle_to_block(ctx, handle);
-            struct buflib_callbacks* ops = last_block[2].ops;
-            if (ops && ops->shrink_callback)
+            struct buflib_callbacks* ops = block_ops(ctx, last_block);
+            if (ops && ops->shrink_callback && !block_pinned(last_block))
             {
                 char *data = buflib_get_data(ctx, handle);
                 unsigned hint = BUFLIB_SHRINK_POS_BACK | 10*sizeof(union buflib_data);
+                ctx->stats.shrink_calls++;
                 if (ops->shrink_callback(handle, hint, data, 
                         (char*)(last_block+last_block->val)-data) == BUFLIB_CB_OK)
-                {   /* retry one more time */
-                    goto handle_alloc;
+                {
+                    ctx->stats.shrinks_ok++;
+                    /* retry one more time, unless the shrink didn't free
+                     * anything at the end */
+                    if (ctx->last_handle > ctx->alloc_end)
+                        goto handle_alloc;
                 }
             }
+            ctx->stats.alloc_failures++;
             return 0;
         }
     }
 
 buffer_alloc:
-    /* need to re-evaluate last before the loop because the last allocation
-     * possibly made room in its front to fit this, so last would be wrong */
+    /* need to re-evaluate last because the last allocation possibly made
+     * room in its front to fit this, so last would be wrong */
     last = false;
-    for (block = ctx->first_free_block;;block += block_len)
+    block = NULL;
+    if (flags & (BUFLIB_ALLOC_LONG_LIVED | BUFLIB_ALLOC_UNMOVABLE))
+    {
+        block = fixed_find(ctx, size);
+        if (block && block + size > ctx->fixed_end)
+            ctx->fixed_end = block + size;
+    }
+    /* short lived allocations leave the holes alone, they'll be gone
+     * before compaction is needed */
+    else if (flags & BUFLIB_ALLOC_SHORT_LIVED
+             && (size_t)(ctx->last_handle - ctx->alloc_end) >= size)
+        block = ctx->alloc_end;
+    if (!block)
+        block = free_find(ctx, size);
+    if (block && block != ctx->alloc_end)
+    {
+        block_len = -block->val;
+        free_remove(ctx, block);
+    }
+    else
     {
         /* If the last used block extends all the way to the handle table, the
          * block "after" it doesn't have a header. Because of this, it's easier
@@ -418,35 +1845,34 @@ buffer_alloc:
          * calculate the free space at the end by comparing it to the
          * last_handle pointer.
          */
-        if(block == ctx->alloc_end)
-        {
-            last = true;
-            block_len = ctx->last_handle - block;
-            if ((size_t)block_len < size)
-                block = NULL;
-            break;
-        }
-        block_len = block->val;
-        /* blocks with positive length are already allocated. */
-        if(block_len > 0)
-            continue;
-        block_len = -block_len;
-        /* The search is first-fit, any fragmentation this causes will be 
-         * handled at compaction.
-         */
-        if ((size_t)block_len >= size)
-            break;
+        block = ctx->alloc_end;
+        last = true;
+        block_len = ctx->last_handle - block;
+        if ((size_t)block_len < size)
+            block = NULL;
     }
     if (!block)
     {
+        /* A growable context grows rather than shrinking allocations, after
+         * compacting if that can make enough room */
+        if (ctx->compact || ctx->free_units < size)
+        {
+            /* growing moves the handle table, handle along with it */
+            int index = ctx->handle_table - handle;
+            if (context_grow(ctx, size))
+            {
+                handle = ctx->handle_table - index;
+                goto buffer_alloc;
+            }
+        }
         /* Try compacting if allocation failed */
         if (buflib_compact_and_shrink(ctx,
                     (size*sizeof(union buflib_data))&BUFLIB_SHRINK_SIZE_MASK))
         {
             goto buffer_alloc;
         } else {
-            handle->val=1;
             handle_free(ctx, handle);
+            ctx->stats.alloc_failures++;
             return 0;
         }
     }
@@ -454,14 +1880,18 @@ buffer_alloc:
     /* Set up the allocated block, by marking the size allocated, and storing
      * a pointer to the handle.
      */
-    union buflib_data *name_len_slot;
     block->val = size;
-    block[1].handle = handle;
+    block_set_handle(ctx, block, handle);
+    name_id = name_intern(ctx, name);
+    name_ref(ctx, name_id);
+#ifdef BUFLIB_COMPACT_HEADER
+    block[1].hdr.info = name_id | ops_index << BUFLIB_NAME_ID_BITS;
+    ops_ref(ctx, ops_index);
+#else
     block[2].ops = ops ?: &default_callbacks;
-    strcpy(block[3].name, name);
-    name_len_slot = (union buflib_data*)B_ALIGN_UP(block[3].name + name_len);
-    name_len_slot->val = 1 + name_len/sizeof(union buflib_data);
-    handle->alloc = (char*)(name_len_slot + 1);
+    block[3].val = name_id;
+#endif
+    handle_set_data(ctx, handle, (char*)(block + BUFLIB_HEADER));
     /* If we have just taken the first free block, the next allocation search
      * can save some time by starting after this block.
      */
@@ -473,76 +1903,142 @@ buffer_alloc:
         ctx->alloc_end = block;
     /* Only free blocks *before* alloc_end have tagged length. */
     else if ((size_t)block_len > size)
-        block->val = size - block_len;
+    {
+        mark_free(block, block_len - size);
+        free_insert(ctx, block);
+    }
+    /* The free block was taken completely, the next one isn't preceded by a
+     * free one anymore */
+    else
+        block_set_prev_free(block, false);
+    ctx->stats.live_handles++;
     /* Return the handle index as a positive integer. */
     return ctx->handle_table - handle;
 }
 
+/* Wait while a thread owns the lock of buflib_alloc_maximum(), ctx must be
+ * locked exactly once */
+static void
+handle_lock_wait(struct buflib_context *ctx)
+{
+    while (ctx->handle_lock != 0)
+    {
+#ifdef BUFLIB_HAVE_THREADS
+        if (ctx->threadsafe)
+        {
+            pthread_cond_wait(&ctx->handle_unlocked, &ctx->mutex);
+            continue;
+        }
+#endif
+        /* busy wait otherwise */
+        YIELD();
+    }
+}
+
+int
+buflib_alloc_ex(struct buflib_context *ctx, size_t size, const char *name,
+                struct buflib_callbacks *ops)
+{
+    return buflib_alloc_flags(ctx, size, name, ops, 0);
+}
+
+/* Like buflib_alloc_ex(), with BUFLIB_ALLOC_* flags telling how the
+ * allocation is going to be used.
+ *
+ * Allocations flagged long lived or unmovable are placed in a zone at the
+ * start of the buffer, where compaction doesn't look, movable allocations
+ * are moved out of the way to grow it. That keeps them from ending up
+ * between movable allocations, where they'd leave holes that compaction
+ * can't close. Short lived allocations are placed at the end of the
+ * allocated space if possible, rather than into holes.
+ */
+int
+buflib_alloc_flags(struct buflib_context *ctx, size_t size, const char *name,
+                   struct buflib_callbacks *ops, unsigned flags)
+{
+    int handle;
+    buflib_lock(ctx);
+    handle_lock_wait(ctx);
+    handle = alloc_ex_unlocked(ctx, size, name, ops, flags);
+    TRACE(ctx, BUFLIB_TRACE_ALLOC, handle, size,
+          trace_alloc_flags(name, ops, flags));
+    buflib_unlock(ctx);
+    return handle;
+}
+
+static void
+free_unlocked(struct buflib_context *ctx, int handle_num)
+{
+    union buflib_data *block = handle_to_block(ctx, handle_num);
+    size_t len = block->val;
+    if (block_pinned(block))
+        ctx->pinned--;
+    ctx->stats.live_handles--;
+    ops_unref(ctx, block);
+    name_unref(ctx, block);
+    block = free_block(ctx, block);
+    pages_return_block(ctx, block, len);
+    handle_free(ctx, ctx->handle_table - handle_num);
+
+    /* if the handle is the one aquired with buflib_alloc_maximum()
+     * unlock buflib_alloc() as part of the shrink */
+    handle_unlock(ctx, handle_num);
+    compactor_poke(ctx);
+}
+
 /* Free the buffer associated with handle_num. */
 void
 buflib_free(struct buflib_context *ctx, int handle_num)
 {
-    union buflib_data *handle = ctx->handle_table - handle_num,
-                      *freed_block = handle_to_block(ctx, handle_num),
-                      *block = ctx->first_free_block,
-                      *next_block = block;
-    /* We need to find the block before the current one, to see if it is free
-     * and can be merged with this one.
-     */
-    while (next_block < freed_block)
-    {
-        block = next_block;
-        next_block += abs(block->val);
-    }
-    /* If next_block == block, the above loop didn't go anywhere. If it did,
-     * and the block before this one is empty, we can combine them.
-     */
-    if (next_block == freed_block && next_block != block && block->val < 0)
-        block->val -= freed_block->val;
-    /* Otherwise, set block to the newly-freed block, and mark it free, before
-     * continuing on, since the code below exects block to point to a free
-     * block which may have free space after it.
-     */
-    else
+    buflib_lock(ctx);
+    TRACE(ctx, BUFLIB_TRACE_FREE, handle_num, 0, 0);
+    free_unlocked(ctx, handle_num);
+    buflib_unlock(ctx);
+}
+
+/* Keep an allocation in place until as many buflib_unpin() calls follow, so
+ * that its data can be accessed through a plain pointer meanwhile. Compaction
+ * neither moves nor shrinks pinned allocations, and their callbacks aren't
+ * called.
+ */
+void
+buflib_pin(struct buflib_context *ctx, int handle)
+{
+    buflib_lock(ctx);
+    union buflib_data *block = handle_to_block(ctx, handle);
+    if (!block_pinned(block))
+        ctx->pinned++;
+    BUFLIB_BLOCK_INFO(block) += BUFLIB_PIN_ONE;
+    buflib_unlock(ctx);
+}
+
+void
+buflib_unpin(struct buflib_context *ctx, int handle)
+{
+    buflib_lock(ctx);
+    union buflib_data *block = handle_to_block(ctx, handle);
+    BUFLIB_BLOCK_INFO(block) -= BUFLIB_PIN_ONE;
+    if (!block_pinned(block))
     {
-        block = freed_block;
-        block->val = -block->val;
-    }
-    next_block = block - block->val;
-    /* Check if we are merging with the free space at alloc_end. */
-    if (next_block == ctx->alloc_end)
-        ctx->alloc_end = block;
-    /* Otherwise, the next block might still be a "normal" free block, and the
-     * mid-allocation free means that the buffer is no longer compact.
-     */
-    else {
+        ctx->pinned--;
+        /* compaction may have given up because of it */
         ctx->compact = false;
-        if (next_block->val < 0)
-            block->val += next_block->val;
     }
-    handle_free(ctx, handle);
-    handle->alloc = NULL;
-    /* If this block is before first_free_block, it becomes the new starting
-     * point for free-block search.
-     */
-    if (block < ctx->first_free_block)
-        ctx->first_free_block = block;
-
-    /* if the handle is the one aquired with buflib_alloc_maximum()
-     * unlock buflib_alloc() as part of the shrink */
-    if (ctx->handle_lock == handle_num)
-        ctx->handle_lock = 0;
+    buflib_unlock(ctx);
 }
 
 /* Return the maximum allocatable memory in bytes */
 size_t
 buflib_available(struct buflib_context* ctx)
 {
-    /* subtract 5 elements for
-     * val, handle, name_len, ops and the handle table entry*/
-    size_t diff = (ctx->last_handle - ctx->alloc_end - 5);
+    buflib_lock(ctx);
+    /* subtract the header and the handle table entry */
+    intptr_t diff = (ctx->last_handle - ctx->alloc_end - BUFLIB_HEADER - 1);
+    buflib_unlock(ctx);
     diff *= sizeof(union buflib_data); /* make it bytes */
-    diff -= 16; /* reserve 16 for the name */
+    /* leave room for a few handles, so that allocating is still possible
+     * once buflib_alloc_maximum() shrinks from the front */
+    diff -= 16;
 
     if (diff > 0)
         return diff;
@@ -563,15 +2059,19 @@ buflib_alloc_maximum(struct buflib_context* ctx, const char* name, size_t *size,
 {
     int handle;
 
-    /* limit name to 16 since that's what buflib_available() accounts for it */
-    char buf[16];
+    /* nobody may allocate between measuring and allocating */
+    buflib_lock(ctx);
+    handle_lock_wait(ctx);
     *size = buflib_available(ctx);
-    strlcpy(buf, name, sizeof(buf));
-    handle = buflib_alloc_ex(ctx, *size, buf, ops);
+    /* it's meant to be shrunk soon, and takes the end of the buffer anyway */
+    handle = alloc_ex_unlocked(ctx, *size, name, ops, BUFLIB_ALLOC_SHORT_LIVED);
+    TRACE(ctx, BUFLIB_TRACE_ALLOC_MAXIMUM, handle, *size,
+          trace_alloc_flags(name, ops, 0));
 
     if (handle > 0) /* shouldn't happen ?? */
         ctx->handle_lock = handle;
-    
+    buflib_unlock(ctx);
+
     return handle;
 }
 
@@ -579,8 +2079,8 @@ buflib_alloc_maximum(struct buflib_context* ctx, const char* name, size_t *size,
  * new_size. Grow is not possible, therefore new_start and new_start + new_size
  * must be within the original allocation
  */
-bool
-buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t new_size)
+static bool
+shrink_unlocked(struct buflib_context* ctx, int handle, void* new_start, size_t new_size)
 {
     char* oldstart = buflib_get_data(ctx, handle);
     char* newstart = new_start;
@@ -607,35 +2107,33 @@ buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t ne
     new_block = aligned_newstart - metadata_size.val;
     block[0].val = new_next_block - new_block;
 
-    block[1].handle->alloc = newstart;
+    handle_set_data(ctx, block_handle(ctx, block), newstart);
     if (block != new_block)
     {
-        /* move metadata over, i.e. pointer to handle table entry and name
+        /* move metadata over, i.e. pointer to handle table entry and name id
          * This is actually the point of no return. Data in the allocation is
          * being modified, and therefore we must successfully finish the shrink
          * operation */
+        bool prev_free = block_prev_free(block);
         memmove(new_block, block, metadata_size.val*sizeof(metadata_size));
-        /* mark the old block unallocated */
-        block->val = block - new_block;
-        union buflib_data *freed_block = block,
-                          *free_before = ctx->first_free_block,
-                          *next_block = free_before;
-        /* We need to find the block before the current one, to see if it is free
-         * and can be merged with this one.
-         */
-        while (next_block < freed_block)
+        /* mark the old block unallocated, if the block before it is free,
+         * its boundary tag gives its length and we can combine them. */
+        union buflib_data *freed_block = block;
+        intptr_t freed_len = new_block - block;
+        if (prev_free)
         {
-            free_before = next_block;
-            next_block += abs(block->val);
+            freed_block += block[-1].val;
+            free_remove(ctx, freed_block);
+            freed_len -= freed_block->val;
         }
-        /* If next_block == free_before, the above loop didn't go anywhere.
-         * If it did, and the block before this one is empty, we can combine them.
-         */
-        if (next_block == freed_block && next_block != free_before && free_before->val < 0)
-            free_before->val += freed_block->val;
-        else if (next_block == free_before)
+        mark_free(freed_block, freed_len);
+        free_insert(ctx, freed_block);
+        compact_cursor_merged(ctx, freed_block, freed_block + freed_len);
+        fixed_trim(ctx, freed_block, freed_block + freed_len);
+        block_set_prev_free(new_block, true);
+        if (freed_block < ctx->first_free_block)
             ctx->first_free_block = freed_block;
-            
+
         /* We didn't handle size changes yet, assign block to the new one
          * the code below the wants block whether it changed or not */
         block = new_block;
@@ -645,15 +2143,26 @@ buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t ne
     if (old_next_block != new_next_block)
     {
         if (ctx->alloc_end == old_next_block)
+        {
             ctx->alloc_end = new_next_block;
+            compact_cursor_merged(ctx, new_next_block, ctx->handle_table);
+            fixed_trim(ctx, new_next_block, ctx->handle_table);
+        }
         else if (old_next_block->val < 0)
         {   /* enlarge next block by moving it up */
-            new_next_block->val = old_next_block->val - (old_next_block - new_next_block);
+            free_remove(ctx, old_next_block);
+            mark_free(new_next_block, (old_next_block - new_next_block)
+                                      - old_next_block->val);
+            free_insert(ctx, new_next_block);
+            compact_cursor_merged(ctx, new_next_block, old_next_block + 1);
+            fixed_trim(ctx, new_next_block, old_next_block + 1);
         }
         else if (old_next_block != new_next_block)
         {   /* creating a hole */
-            /* must be negative to indicate being unallocated */
-            new_next_block->val = new_next_block - old_next_block;
+            mark_free(new_next_block, old_next_block - new_next_block);
+            free_insert(ctx, new_next_block);
+            block_set_prev_free(old_next_block, true);
+            fixed_trim(ctx, new_next_block, old_next_block);
         }
         /* update first_free_block for the newly created free space */
         if (ctx->first_free_block > new_next_block)
@@ -662,8 +2171,454 @@ buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t ne
 
     /* if the handle is the one aquired with buflib_alloc_maximum()
      * unlock buflib_alloc() as part of the shrink */
-    if (ctx->handle_lock == handle)
-        ctx->handle_lock = 0;
+    handle_unlock(ctx, handle);
+
+    return true;
+}
+
+bool
+buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t new_size)
+{
+    bool ret;
+    buflib_lock(ctx);
+#ifdef BUFLIB_HAVE_TRACE
+    char *old_start = buflib_get_data(ctx, handle);
+#endif
+    ret = shrink_unlocked(ctx, handle, new_start, new_size);
+    if (ret)
+        TRACE(ctx, BUFLIB_TRACE_SHRINK, handle,
+              (char*)new_start - old_start, new_size);
+    compactor_poke(ctx);
+    buflib_unlock(ctx);
+    return ret;
+}
+
+/* Grow the allocation in place into the free block after it or the free
+ * space at alloc_end, new_end being the end of the grown block */
+static bool
+grow_in_place(struct buflib_context *ctx, union buflib_data *block,
+              union buflib_data *new_end)
+{
+    union buflib_data *end = block + block->val;
+    if (end == ctx->alloc_end)
+    {
+        if (new_end > ctx->last_handle)
+            return false;
+        ctx->alloc_end = new_end;
+    }
+    else if (end->val < 0 && end - end->val >= new_end)
+    {
+        union buflib_data *next = end - end->val;
+        free_remove(ctx, end);
+        if (next > new_end)
+        {
+            mark_free(new_end, next - new_end);
+            free_insert(ctx, new_end);
+        }
+        else if (next < ctx->alloc_end)
+            block_set_prev_free(next, false);
+    }
+    else
+        return false;
+    /* the cursor may rest at the start of the free block or at alloc_end */
+    if (ctx->compact_cursor >= end && ctx->compact_cursor < new_end)
+        ctx->compact_cursor = new_end;
+    if (ctx->first_free_block >= end && ctx->first_free_block < new_end)
+        ctx->first_free_block = new_end;
+    /* a fixed allocation grows the fixed zone */
+    if (block < ctx->fixed_end && ctx->fixed_end < new_end)
+        ctx->fixed_end = new_end;
+    block->val = new_end - block;
+    return true;
+}
+
+/* Give a copy of the allocation of handle new_size bytes, in a new block.
+ * The handle is kept, it refers to the new block afterwards. */
+static bool
+relocate(struct buflib_context *ctx, int handle, size_t new_size)
+{
+    union buflib_data *block = handle_to_block(ctx, handle);
+    union buflib_data *entry, *new_entry;
+    unsigned name_id = BUFLIB_BLOCK_INFO(block) & BUFLIB_NAME_ID_MASK;
+    int new_handle;
+    bool prev_free;
+    char *data;
+    size_t old_size;
+
+    if (block_pinned(block))
+        return false;
+    new_handle = alloc_ex_unlocked(ctx, new_size, name_of(ctx, name_id),
+                                   block_ops(ctx, block), block < ctx->fixed_end
+                                        ? BUFLIB_ALLOC_LONG_LIVED : 0);
+    if (new_handle <= 0)
+        return false;
+    /* making room may have moved or shrunk the old block, and growing the
+     * context moves the handle table */
+    entry = ctx->handle_table - handle;
+    block = handle_to_block(ctx, handle);
+    data = buflib_get_data(ctx, handle);
+    old_size = (char*)(block + block->val) - data;
+    new_entry = ctx->handle_table - new_handle;
+    buflib_move_data(handle_data(ctx, new_entry), data,
+                     old_size < new_size ? old_size : new_size);
+
+    /* swap the blocks of both handles, then free the old block through the
+     * new handle */
+    prev_free = block_prev_free(block);
+    block_set_handle(ctx, block, new_entry);
+    block_set_prev_free(block, prev_free);
+    entry->val = new_entry->val;
+    handle_set_data(ctx, new_entry, data);
+    block = handle_to_block(ctx, handle);
+    prev_free = block_prev_free(block);
+    block_set_handle(ctx, block, entry);
+    block_set_prev_free(block, prev_free);
+    free_unlocked(ctx, new_handle);
+    return true;
+}
+
+/* Resize the allocation of handle to new_size bytes from the current start
+ * of its data, keeping the handle and the data up to the smaller of both
+ * sizes. Growing happens in place if the allocation is followed by enough
+ * free space, possibly after compacting. Otherwise the data is copied to a
+ * new block, which needs the old and the new size to be available at once
+ * and isn't possible for pinned allocations.
+ *
+ * Returns true on success, the data may have moved then. Nothing changes if
+ * it fails.
+ */
+bool
+buflib_realloc(struct buflib_context *ctx, int handle, size_t new_size)
+{
+    bool ret = true;
+    buflib_lock(ctx);
+    if (ctx->handle_lock != handle)
+        handle_lock_wait(ctx);
+    char *data = buflib_get_data(ctx, handle);
+    union buflib_data *block = handle_to_block(ctx, handle),
+                      *new_end = (union buflib_data*)B_ALIGN_UP(data + new_size);
+
+    if (new_end <= block + block->val)
+        ret = shrink_unlocked(ctx, handle, data, new_size);
+    else if (!grow_in_place(ctx, block, new_end))
+    {
+        /* compaction gathers the free space at alloc_end, the allocation
+         * might be the last one after it */
+        if (!ctx->compact && buflib_compact(ctx))
+        {
+            data = buflib_get_data(ctx, handle);
+            block = handle_to_block(ctx, handle);
+            new_end = (union buflib_data*)B_ALIGN_UP(data + new_size);
+            ret = grow_in_place(ctx, block, new_end);
+        }
+        else
+            ret = false;
+        if (!ret)
+            ret = relocate(ctx, handle, new_size);
+    }
+    if (ret)
+        TRACE(ctx, BUFLIB_TRACE_REALLOC, handle, new_size, 0);
+    buflib_unlock(ctx);
+    return ret;
+}
+
+/* A snapshot is this header, followed by the names, the blocks from buf_start
+ * to alloc_end and the handle table, in native byte order. The pointers are
+ * the ones of the context that was saved, for relocating.
+ */
+#define BUFLIB_SNAPSHOT_MAGIC   0x424c534e /* "BLSN" */
+#define BUFLIB_SNAPSHOT_VERSION 1
+
+struct snapshot_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t header;         /* BUFLIB_HEADER */
+    uint8_t data_size;      /* sizeof(union buflib_data) */
+    union buflib_data *buf_start;
+    union buflib_data *handle_table;
+    size_t blocks;          /* units from buf_start to alloc_end */
+    size_t handles;         /* units from last_handle to handle_table */
+    size_t fixed;           /* units from buf_start to fixed_end */
+    intptr_t first_free_handle; /* handle index, 0 if there's none */
+    size_t names_used;
+};
+
+/* Write all of buf, a call may write less (at most about 2GiB on Linux, or
+ * what a pipe takes) or be interrupted by a signal */
+static bool
+write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Read all of buf, false if the file ends before */
+static bool
+read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Save the allocations of ctx to fd, so that they can be brought back with
+ * buflib_restore(), possibly by another run of the program. Returns false if
+ * writing failed.
+ */
+bool
+buflib_snapshot(struct buflib_context *ctx, int fd)
+{
+    struct snapshot_header header = {
+        .magic = BUFLIB_SNAPSHOT_MAGIC,
+        .version = BUFLIB_SNAPSHOT_VERSION,
+        .header = BUFLIB_HEADER,
+        .data_size = sizeof(union buflib_data),
+    };
+    bool ret;
+    buflib_lock(ctx);
+    header.buf_start = ctx->buf_start;
+    header.handle_table = ctx->handle_table;
+    header.blocks = ctx->alloc_end - ctx->buf_start;
+    header.handles = ctx->handle_table - ctx->last_handle;
+    header.fixed = ctx->fixed_end - ctx->buf_start;
+    header.first_free_handle = ctx->first_free_handle ?
+                        ctx->handle_table - ctx->first_free_handle : 0;
+    header.names_used = ctx->names.used;
+    ret = write_all(fd, &header, sizeof(header))
+       && write_all(fd, ctx->names.strings, ctx->names.used)
+       && write_all(fd, ctx->buf_start,
+                    header.blocks * sizeof(union buflib_data))
+       && write_all(fd, ctx->last_handle,
+                    header.handles * sizeof(union buflib_data));
+    buflib_unlock(ctx);
+    return ret;
+}
+
+/* Get the handle index of a block as it was in the saved context */
+static inline intptr_t
+snapshot_handle(struct buflib_context *ctx, union buflib_data *block,
+                struct snapshot_header *header)
+{
+#ifdef BUFLIB_COMPACT_HEADER
+    (void)ctx;(void)header;
+    return block[1].hdr.handle >> 1;
+#else
+    return header->handle_table - block_handle(ctx, block);
+#endif
+}
+
+/* Check that the blocks and the handle table read from a snapshot are
+ * consistent, a snapshot is likely to be kept in a file that may be damaged
+ * or cut short. Every block must be within alloc_end, free ones with their
+ * boundary tag, allocated ones with a valid name and a handle table entry
+ * that points back into them. The free handles must form a list without
+ * loops.
+ */
+static bool
+restore_check(struct buflib_context *ctx, struct snapshot_header *header)
+{
+    union buflib_data *block, *entry;
+    intptr_t len, index;
+    size_t id, used = 0, free_handles = 0, listed = 0;
+    bool prev_free = false, fixed_seen = header->fixed == header->blocks;
+
+    if (header->names_used && ctx->names.strings[header->names_used - 1])
+        return false;
+    for (block = ctx->buf_start; block < ctx->alloc_end; block += len)
+    {
+        if (block == ctx->fixed_end)
+            fixed_seen = true;
+        len = ctx->alloc_end - block;
+        if (!block->val || block->val > len || block->val < -len)
+            return false;
+        len = block_len(block);
+        if (block->val < 0)
+        {
+            if (prev_free || block[len-1].val != block->val)
+                return false;
+            prev_free = true;
+            continue;
+        }
+        index = snapshot_handle(ctx, block, header);
+        id = BUFLIB_BLOCK_INFO(block) & BUFLIB_NAME_ID_MASK;
+        /* names are counted at their start, which follows the end of the
+         * one before */
+        if (len < BUFLIB_HEADER || block_prev_free(block) != prev_free
+                || id > header->names_used
+                || (id > 1 && ctx->names.strings[id - 2])
+                || index < 1 || (size_t)index > header->handles)
+            return false;
+        entry = ctx->handle_table - index;
+        if (entry->val < (block + BUFLIB_HEADER - ctx->buf_start)
+                            * (intptr_t)sizeof(union buflib_data)
+                || entry->val > (block + len - ctx->buf_start)
+                            * (intptr_t)sizeof(union buflib_data))
+            return false;
+        prev_free = false;
+        used++;
+    }
+    if (!fixed_seen || header->first_free_handle < 0
+            || (size_t)header->first_free_handle > header->handles)
+        return false;
+    /* blocks don't overlap, as many used entries as blocks means that each
+     * of them is pointed to by one block */
+    for (entry = ctx->last_handle; entry < ctx->handle_table; entry++)
+        if (entry->val < 0)
+            free_handles++;
+    if (used + free_handles != header->handles)
+        return false;
+    for (index = header->first_free_handle; index; index = ~entry->val)
+    {
+        entry = ctx->handle_table - index;
+        if (++listed > free_handles || entry->val >= 0
+                || (size_t)~entry->val > header->handles)
+            return false;
+    }
+    return true;
+}
 
+/* Set up the header of a restored block: its ops are looked up by its name,
+ * pins were the ones of the saved program. Returns false if the ops don't
+ * fit into the table of the context.
+ */
+static bool
+restore_block(struct buflib_context *ctx, union buflib_data *block,
+              struct snapshot_header *header,
+              struct buflib_callbacks* (*get_ops)(const char *name))
+{
+    unsigned id = BUFLIB_BLOCK_INFO(block) & BUFLIB_NAME_ID_MASK;
+    const char *name = name_of(ctx, id);
+    struct buflib_callbacks *ops = get_ops && name ? get_ops(name) : NULL;
+#ifdef BUFLIB_COMPACT_HEADER
+    int ops_index = ops_register(ctx, ops);
+    (void)header;
+    if (ops_index < 0)
+        return false;
+    BUFLIB_BLOCK_INFO(block) = id | ops_index << BUFLIB_NAME_ID_BITS;
+    ops_ref(ctx, ops_index);
+#else
+    bool prev_free = block_prev_free(block);
+    block_set_handle(ctx, block,
+                     ctx->handle_table - snapshot_handle(ctx, block, header));
+    block_set_prev_free(block, prev_free);
+    block[2].ops = ops ?: &default_callbacks;
+    BUFLIB_BLOCK_INFO(block) = id;
+#endif
+    name_ref(ctx, id);
     return true;
 }
+
+/* Tell the owner of an allocation where it is now, compared to where it was
+ * in the saved context */
+static void
+restore_move(struct buflib_context *ctx, union buflib_data *block,
+             struct snapshot_header *header)
+{
+    struct buflib_callbacks *ops = block_ops(ctx, block);
+    union buflib_data *entry = block_handle(ctx, block);
+    struct buflib_move move = {
+        .handle = ctx->handle_table - entry,
+        .old = (char*)header->buf_start + entry->val,
+        .new = handle_data(ctx, entry),
+    };
+    if (ops->move_batch_callback)
+        ops->move_batch_callback(BUFLIB_MOVE_DONE, &move, 1);
+    else if (ops->move_callback)
+        ops->move_callback(move.handle, move.old, move.new);
+}
+
+/* Bring back the allocations saved with buflib_snapshot() into ctx, which
+ * must have no allocations and a buffer at least as big as the saved part
+ * of the saved one. The handles stay the same. get_ops gives the callbacks
+ * of the allocations by their name, NULL for the default ones. If the buffer
+ * isn't at the same address, the owners are told about the new place of
+ * their allocations through their move callbacks, as if they were moved.
+ * Unlike when compacting, the data is at the new place already then, and
+ * batch owners are only called for BUFLIB_MOVE_DONE, once per allocation.
+ *
+ * Returns false if the snapshot can't be read, is damaged or doesn't fit,
+ * ctx has no allocations then.
+ */
+bool
+buflib_restore(struct buflib_context *ctx, int fd,
+               struct buflib_callbacks* (*get_ops)(const char *name))
+{
+    struct snapshot_header header;
+    union buflib_data *block;
+    bool ret = false;
+    buflib_lock(ctx);
+    if (ctx->alloc_end != ctx->buf_start || ctx->last_handle != ctx->handle_table)
+        goto out;
+    if (!read_all(fd, &header, sizeof(header))
+            || header.magic != BUFLIB_SNAPSHOT_MAGIC
+            || header.version != BUFLIB_SNAPSHOT_VERSION
+            || header.header != BUFLIB_HEADER
+            || header.data_size != sizeof(union buflib_data)
+            || header.names_used > BUFLIB_NAME_SPACE
+            || header.fixed > header.blocks
+            || header.blocks + header.handles < header.blocks)
+        goto out;
+    if (header.blocks + header.handles
+                > (size_t)(ctx->handle_table - ctx->buf_start)
+            && !context_grow(ctx, header.blocks + header.handles
+                                - (ctx->handle_table - ctx->buf_start)))
+        goto out;
+    ctx->last_handle = ctx->handle_table - header.handles;
+    ctx->alloc_end = ctx->buf_start + header.blocks;
+    /* the ids remembered for recent names are of other strings now */
+    memset(ctx->names.recent, 0, sizeof(ctx->names.recent));
+    ctx->names.used = header.names_used;
+    if (!read_all(fd, ctx->names.strings, header.names_used)
+            || !read_all(fd, ctx->buf_start,
+                         header.blocks * sizeof(union buflib_data))
+            || !read_all(fd, ctx->last_handle,
+                         header.handles * sizeof(union buflib_data)))
+        goto out;
+    ctx->fixed_end = ctx->buf_start + header.fixed;
+    if (!restore_check(ctx, &header))
+        goto out;
+    ctx->first_free_handle = header.first_free_handle ?
+                    ctx->handle_table - header.first_free_handle : NULL;
+    /* the free lists are set up again rather than relocated */
+    for (block = ctx->buf_start; block < ctx->alloc_end; block += block_len(block))
+    {
+        if (block->val < 0)
+            free_insert(ctx, block);
+        else if (restore_block(ctx, block, &header, get_ops))
+            ctx->stats.live_handles++;
+        else
+            goto out;
+    }
+    ctx->compact = ctx->free_units == 0;
+    if (ctx->buf_start != header.buf_start)
+        for (block = ctx->buf_start; block < ctx->alloc_end;
+                block += block_len(block))
+            if (block->val > 0)
+                restore_move(ctx, block, &header);
+    ret = true;
+out:
+    if (!ret)
+        context_clear(ctx);
+    buflib_unlock(ctx);
+    return ret;
+}
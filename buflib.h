@@ -30,6 +30,24 @@
 #include <string.h>
 #include "proposed-api.h"
 
+/* Contexts can be made safe for use by several threads, where supported */
+#if defined(__unix) && (__unix == 1)
+#include <pthread.h>
+#define BUFLIB_HAVE_THREADS
+#endif
+
+/* Contexts can grow into reserved address space and give free memory back
+ * to the OS, where supported */
+#if defined(__unix) && (__unix == 1)
+#define BUFLIB_HAVE_VM
+#endif
+
+/* Allocation traces can be recorded to files, not for Rockbox */
+#ifndef ROCKBOX
+#include <stdio.h>
+#define BUFLIB_HAVE_TRACE
+#endif
+
 /* from "debug.h" */
 #ifdef DEBUG
     #include <stdio.h>
@@ -54,28 +72,215 @@
     ptr = (typeof(ptr))tmp_ptr1; \
 }
 
+/* On 64-bit hosts the header of an allocation is packed into two
+ * buflib_data instead of four, unless BUFLIB_NO_COMPACT_HEADER is defined */
+#if UINTPTR_MAX > 0xffffffff && !defined(BUFLIB_NO_COMPACT_HEADER)
+#define BUFLIB_COMPACT_HEADER
+#endif
+
 union buflib_data
 {
-    intptr_t val;
-    char name[1]; /* actually a variable sized string */
+    intptr_t val; /* for handle table entries, where the data starts
+                   * relative to buf_start */
     struct buflib_callbacks* ops;
-    char* alloc;
     union buflib_data *handle;
+#ifdef BUFLIB_COMPACT_HEADER
+    struct {
+        uint32_t handle; /* handle table index << 1 | BUFLIB_PREV_FREE */
+        uint32_t info;
+    } hdr;
+#endif
+};
+
+/* The header of an allocation holds an info word with the id of its name in
+ * the low bits, and how often the allocation is pinned in the high bits.
+ *
+ * The full header is the length, the pointer to the handle table entry, the
+ * ops pointer and the info word. The compact header is the length, followed
+ * by the index of the handle table entry and the info word in one
+ * buflib_data, the ops are kept in a table in the context and the info word
+ * has their index in the middle bits.
+ */
+#ifdef BUFLIB_COMPACT_HEADER
+#define BUFLIB_HEADER        2
+#define BUFLIB_BLOCK_INFO(block) ((block)[1].hdr.info)
+#define BUFLIB_NAME_ID_BITS  12
+#define BUFLIB_OPS_BITS      8
+#define BUFLIB_OPS_MASK      ((1 << BUFLIB_OPS_BITS) - 1)
+#define BUFLIB_NUM_OPS       (1 << BUFLIB_OPS_BITS)
+#define BUFLIB_PIN_ONE       (1 << (BUFLIB_NAME_ID_BITS + BUFLIB_OPS_BITS))
+#else
+#define BUFLIB_HEADER        4
+#define BUFLIB_BLOCK_INFO(block) ((block)[3].val)
+#define BUFLIB_NAME_ID_BITS  16
+#define BUFLIB_PIN_ONE       (1 << BUFLIB_NAME_ID_BITS)
+#endif
+#define BUFLIB_NAME_ID_MASK  ((1 << BUFLIB_NAME_ID_BITS) - 1)
+
+/* Allocation names are stored once per context. The id of a name is its
+ * offset in strings plus one, 0 stands for no name (or no space left for
+ * it). Recently used name pointers are remembered, so that allocating
+ * with the same name again only needs to compare it to the stored one.
+ * The allocations with a name are counted at its offset in refs, the space
+ * of names without allocations is taken over by new ones.
+ */
+#define BUFLIB_NAME_SPACE    1024
+#define BUFLIB_NAME_RECENT   16
+#if BUFLIB_NAME_SPACE >= (1 << BUFLIB_NAME_ID_BITS)
+#error "BUFLIB_NAME_SPACE too big for the name ids"
+#endif
+struct buflib_names
+{
+    const char *recent[BUFLIB_NAME_RECENT];
+    uint16_t recent_id[BUFLIB_NAME_RECENT];
+    size_t used;
+    char strings[BUFLIB_NAME_SPACE];
+    unsigned refs[BUFLIB_NAME_SPACE];
 };
 
+#ifdef BUFLIB_HAVE_TRACE
+/* A trace is a sequence of these, in native byte order. It starts with a
+ * BUFLIB_TRACE_INIT record, each further one records a call that succeeded
+ * or, for allocations, failed:
+ *
+ * op                     handle          a               b
+ * BUFLIB_TRACE_INIT      0               buffer size     0
+ * BUFLIB_TRACE_ALLOC     result          size            name length | flags
+ * BUFLIB_TRACE_FREE      handle          0               0
+ * BUFLIB_TRACE_SHRINK    handle          new start - old start   new size
+ * BUFLIB_TRACE_ALLOC_MAXIMUM result      size            name length | flags
+ * BUFLIB_TRACE_BUFFER_OUT 0              requested size  size taken out
+ * BUFLIB_TRACE_BUFFER_IN 0               size            0
+ * BUFLIB_TRACE_REALLOC   handle          new size        0
+ */
+struct buflib_trace_record
+{
+    uint32_t op;
+    int32_t handle;
+    uint32_t a;
+    uint32_t b;
+};
+
+enum {
+    BUFLIB_TRACE_INIT,
+    BUFLIB_TRACE_ALLOC,
+    BUFLIB_TRACE_FREE,
+    BUFLIB_TRACE_SHRINK,
+    BUFLIB_TRACE_ALLOC_MAXIMUM,
+    BUFLIB_TRACE_BUFFER_OUT,
+    BUFLIB_TRACE_BUFFER_IN,
+    BUFLIB_TRACE_REALLOC,
+};
+
+/* flags describing the callbacks of an allocation */
+#define BUFLIB_TRACE_MOVABLE   (1<<16)
+#define BUFLIB_TRACE_SHRINKABLE (1<<17)
+#define BUFLIB_TRACE_NAME_MASK ((1<<16)-1)
+/* the BUFLIB_ALLOC_* flags given, above those */
+#define BUFLIB_TRACE_ALLOC_FLAGS_SHIFT 18
+#endif
+
+/* Counters for watching a context, see buflib_get_stats() */
+struct buflib_stats
+{
+    size_t live_bytes;      /* taken by allocations, including their headers */
+    size_t free_bytes;      /* free between allocations and at the end */
+    size_t largest_free;    /* size of the biggest free block */
+    int live_handles;
+    int holes;              /* free blocks between allocations */
+    unsigned long compactions; /* compaction passes or steps */
+    uint64_t moved_bytes;
+    unsigned long shrink_calls; /* shrink callbacks called by compaction */
+    unsigned long shrinks_ok;   /* ... which returned BUFLIB_CB_OK */
+    unsigned long alloc_failures;
+    unsigned long grows;        /* times a growable context grew */
+#ifdef BUFLIB_HAVE_VM
+    uint64_t returned_bytes;    /* free memory given back to the OS */
+    size_t reserved_bytes;      /* the buffer, or the growable reserve */
+#endif
+};
+
+/* Number of size classes for free blocks, class n holds free blocks of
+ * [2^n, 2^(n+1)) buflib_data units (the last one holds anything bigger) */
+#define BUFLIB_NUM_BINS 32
+
 struct buflib_context
 {
     union buflib_data *handle_table;
     union buflib_data *first_free_handle;
     union buflib_data *last_handle;
     union buflib_data *first_free_block;
+    /* end of the zone at buf_start holding unmovable and long lived
+     * allocations, see buflib_alloc_flags() */
+    union buflib_data *fixed_end;
     union buflib_data *buf_start;
     union buflib_data *alloc_end;
+    union buflib_data *free_bins[BUFLIB_NUM_BINS];
+    uint32_t free_bins_map;
+    size_t free_units; /* free space in front of alloc_end */
+    struct buflib_stats stats; /* only the counters are kept up to date */
+    struct buflib_names names;
+#ifdef BUFLIB_COMPACT_HEADER
+    /* the ops of allocations, by the index in their header, 0 is the
+     * default callbacks. Entries without allocations are reused */
+    struct buflib_callbacks *ops[BUFLIB_NUM_OPS];
+    unsigned ops_refs[BUFLIB_NUM_OPS];
+#endif
+    union buflib_data *compact_cursor;
     volatile int handle_lock;
+    int pinned; /* number of pinned allocations */
     bool compact;
+#ifdef BUFLIB_HAVE_THREADS
+    /* set up by buflib_init_locked() only */
+    bool threadsafe;
+    pthread_mutex_t mutex;
+    pthread_cond_t handle_unlocked;
+    struct buflib_compactor *compactor;
+#endif
+#ifdef BUFLIB_HAVE_TRACE
+    FILE *trace;
+#endif
+#ifdef BUFLIB_HAVE_VM
+    /* the address space reserved by buflib_init_growable(), the buffer is
+     * the part of it up to handle_table */
+    void *reserve;
+    size_t reserve_size;
+    /* free space of at least this many bytes is given back to the OS, 0 to
+     * keep it, see buflib_set_page_return() */
+    size_t page_return_min;
+#endif
 };
 
+#ifdef BUFLIB_HAVE_THREADS
+/* A thread compacting a context in the background once frees have left
+ * enough free space between allocations */
+struct buflib_compactor
+{
+    struct buflib_context *ctx;
+    pthread_t thread;
+    pthread_cond_t wake;
+    size_t threshold;
+    size_t step;
+    bool pending;
+    bool stop;
+};
+#endif
+
 void buflib_init(struct buflib_context *context, void *buf, size_t size);
+#ifdef BUFLIB_HAVE_THREADS
+void buflib_init_locked(struct buflib_context *context, void *buf, size_t size);
+bool buflib_compactor_start(struct buflib_compactor *compactor,
+                            struct buflib_context *context,
+                            size_t threshold, size_t step);
+void buflib_compactor_stop(struct buflib_compactor *compactor);
+#endif
+#ifdef BUFLIB_HAVE_VM
+bool buflib_init_growable(struct buflib_context *context, size_t size,
+                          size_t max_size);
+void buflib_release(struct buflib_context *context);
+void buflib_set_page_return(struct buflib_context *context, size_t min_bytes);
+size_t buflib_resident(struct buflib_context *context);
+#endif
 int buflib_alloc(struct buflib_context *context, size_t size);
 void buflib_free(struct buflib_context *context, int handle);
 void* buflib_buffer_out(struct buflib_context *ctx, size_t *size);
@@ -85,6 +290,37 @@ void buflib_buffer_in(struct buflib_context *ctx, int size);
 
 static inline void* buflib_get_data(struct buflib_context *context, int handle)
 {
-    return (void*)(context->handle_table[-handle].alloc);
+    return (char*)context->buf_start + context->handle_table[-handle].val;
+}
+
+/* Serialize access to a context initialized with buflib_init_locked(), the
+ * lock can be taken recursively (e.g. buflib_shrink() from a callback) */
+static inline void buflib_lock(struct buflib_context *context)
+{
+#ifdef BUFLIB_HAVE_THREADS
+    if (context->threadsafe)
+        pthread_mutex_lock(&context->mutex);
+#else
+    (void)context;
+#endif
+}
+
+static inline void buflib_unlock(struct buflib_context *context)
+{
+#ifdef BUFLIB_HAVE_THREADS
+    if (context->threadsafe)
+        pthread_mutex_unlock(&context->mutex);
+#else
+    (void)context;
+#endif
+}
+
+/* Unused handle table entries link to each other with negative values,
+ * allocations never start in front of buf_start */
+static inline bool buflib_handle_is_free(struct buflib_context *context,
+                                         union buflib_data *entry)
+{
+    (void)context;
+    return entry->val < 0;
 }
 #endif
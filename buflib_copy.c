@@ -0,0 +1,125 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Moving buffer contents, bypassing the cache for big moves.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__unix)
+#include <unistd.h>
+#endif
+#include "buflib_copy.h"
+
+size_t buflib_stream_min = SIZE_MAX;
+
+/* Find out how big the last level cache is, once. Without knowing that,
+ * there's no telling which moves would evict anything, and streaming a
+ * move that fits into the cache is much slower, so it stays off */
+void
+buflib_copy_init(void)
+{
+    static bool done;
+    if (done)
+        return;
+    done = true;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+    long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size <= 0)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size <= 0)
+        return;
+    buflib_stream_min = size / 2 > BUFLIB_STREAM_MIN ? (size_t)size / 2
+                                                     : BUFLIB_STREAM_MIN;
+#endif
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* Compaction moves data by a shift that's usually much smaller than the
+ * data, so source and destination overlap. Copying in the direction of the
+ * shift only ever overwrites source bytes that were already loaded, which
+ * holds for the non-temporal stores as well since no later load reads
+ * from where they go.
+ *
+ * Loads are unaligned, the destination is aligned to 16 bytes with a
+ * memmove() of the first (or last) few bytes. 64 bytes are loaded before
+ * any of them is stored, a cache line at a time.
+ */
+void
+buflib_move_stream(void *dst, const void *src, size_t size)
+{
+    char *d = dst;
+    const char *s = src;
+    size_t n;
+    if (size < 64)
+    {
+        memmove(d, s, size);
+        return;
+    }
+    if (d < s)
+    {
+        n = -(uintptr_t)d & 15;
+        memmove(d, s, n);
+        d += n; s += n; size -= n;
+        for (; size >= 64; d += 64, s += 64, size -= 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)s);
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_stream_si128((__m128i*)d, a);
+            _mm_stream_si128((__m128i*)(d + 16), b);
+            _mm_stream_si128((__m128i*)(d + 32), c);
+            _mm_stream_si128((__m128i*)(d + 48), e);
+        }
+        _mm_sfence();
+        memmove(d, s, size);
+    }
+    else
+    {
+        n = (uintptr_t)(d + size) & 15;
+        size -= n;
+        memmove(d + size, s + size, n);
+        for (; size >= 64; size -= 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(s + size - 16));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + size - 32));
+            __m128i c = _mm_loadu_si128((const __m128i*)(s + size - 48));
+            __m128i e = _mm_loadu_si128((const __m128i*)(s + size - 64));
+            _mm_stream_si128((__m128i*)(d + size - 16), a);
+            _mm_stream_si128((__m128i*)(d + size - 32), b);
+            _mm_stream_si128((__m128i*)(d + size - 48), c);
+            _mm_stream_si128((__m128i*)(d + size - 64), e);
+        }
+        _mm_sfence();
+        memmove(d, s, size);
+    }
+}
+
+#else
+
+/* no way to bypass the cache */
+void
+buflib_move_stream(void *dst, const void *src, size_t size)
+{
+    memmove(dst, src, size);
+}
+
+#endif
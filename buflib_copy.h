@@ -0,0 +1,50 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Moving buffer contents, bypassing the cache for big moves.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#ifndef _BUFLIB_COPY_H_
+#define _BUFLIB_COPY_H_
+
+#include <string.h>
+
+/* moves of at least buflib_stream_min bytes bypass the cache, so that moving
+ * big allocations doesn't evict what everything else is working on. It's
+ * set to half the size of the last level cache, but no less than this, by
+ * buflib_copy_init() where that's known, and no move streams otherwise,
+ * anything smaller is faster to move through the cache */
+#ifndef BUFLIB_STREAM_MIN
+#define BUFLIB_STREAM_MIN (256<<10)
+#endif
+
+extern size_t buflib_stream_min;
+
+void buflib_copy_init(void);
+void buflib_move_stream(void *dst, const void *src, size_t size);
+
+/* Like memmove(), the ranges may overlap */
+static inline void buflib_move_data(void *dst, const void *src, size_t size)
+{
+    if (size >= buflib_stream_min)
+        buflib_move_stream(dst, src, size);
+    else
+        memmove(dst, src, size);
+}
+
+#endif /* _BUFLIB_COPY_H_ */
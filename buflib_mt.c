@@ -0,0 +1,180 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Front end that splits one buffer into a buflib context per thread.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#include "buflib_mt.h"
+
+#ifdef BUFLIB_HAVE_THREADS
+
+/* Every thread allocates from its own context, picked round-robin the first
+ * time the thread allocates, so threads don't contend on a lock as long as
+ * there are at least as many contexts as threads. The contexts are still
+ * initialized with buflib_init_locked(), which makes sharing one between
+ * threads safe and keeps the uncontended cost at a mutex lock per call.
+ *
+ * Handles carry the index of their context. Freeing a handle of another
+ * thread's context doesn't take that context's lock, the handle is put into
+ * the context's queue of remote frees instead, a bounded lock-free queue
+ * with a sequence number per slot. The owner frees the queued handles on its
+ * next allocation. Only when the queue is full the lock is taken to free the
+ * handle right away.
+ */
+
+static __thread int thread_index = -1;
+static int next_thread_index;
+
+static struct buflib_mt_part*
+this_part(struct buflib_mt_context *mt)
+{
+    if (thread_index < 0)
+        thread_index = __atomic_fetch_add(&next_thread_index, 1,
+                                          __ATOMIC_RELAXED);
+    return &mt->parts[thread_index % mt->num_contexts];
+}
+
+static bool
+remote_push(struct buflib_mt_part *part, int handle)
+{
+    unsigned long pos = __atomic_load_n(&part->remote_head, __ATOMIC_RELAXED);
+    struct buflib_mt_remote *slot;
+    for (;;)
+    {
+        slot = &part->remote[pos % BUFLIB_MT_REMOTE_FREES];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&part->remote_head, &pos, pos + 1,
+                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) /* full */
+            return false;
+        else
+            pos = __atomic_load_n(&part->remote_head, __ATOMIC_RELAXED);
+    }
+    slot->handle = handle;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* must be called with part->ctx locked, that makes this the only consumer */
+static void
+remote_drain(struct buflib_mt_part *part)
+{
+    unsigned long pos = part->remote_tail;
+    for (;;)
+    {
+        struct buflib_mt_remote *slot = &part->remote[pos % BUFLIB_MT_REMOTE_FREES];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        buflib_free(&part->ctx, slot->handle);
+        __atomic_store_n(&slot->seq, pos + BUFLIB_MT_REMOTE_FREES,
+                         __ATOMIC_RELEASE);
+        pos++;
+    }
+    part->remote_tail = pos;
+}
+
+/* Initialize num_contexts contexts, sharing size bytes at buf equally */
+void
+buflib_mt_init(struct buflib_mt_context *mt, void *buf, size_t size,
+               int num_contexts)
+{
+    size_t part_size;
+    int i, j;
+    if (num_contexts < 1)
+        num_contexts = 1;
+    if (num_contexts > BUFLIB_MT_MAX_CONTEXTS)
+        num_contexts = BUFLIB_MT_MAX_CONTEXTS;
+    part_size = size / num_contexts & ~(sizeof(union buflib_data) - 1);
+    mt->num_contexts = num_contexts;
+    for (i = 0; i < num_contexts; i++)
+    {
+        struct buflib_mt_part *part = &mt->parts[i];
+        buflib_init_locked(&part->ctx, (char*)buf + i * part_size, part_size);
+        part->remote_head = part->remote_tail = 0;
+        for (j = 0; j < BUFLIB_MT_REMOTE_FREES; j++)
+            part->remote[j].seq = j;
+    }
+}
+
+/* Allocate from the calling thread's context, see buflib_alloc_ex() */
+int
+buflib_mt_alloc_ex(struct buflib_mt_context *mt, size_t size,
+                   const char *name, struct buflib_callbacks *ops)
+{
+    struct buflib_mt_part *part = this_part(mt);
+    int handle;
+    buflib_lock(&part->ctx);
+    remote_drain(part);
+    handle = buflib_alloc_ex(&part->ctx, size, name, ops);
+    buflib_unlock(&part->ctx);
+    if (handle <= 0)
+        return 0;
+    /* a handle that doesn't fit next to the context index is a failure */
+    if (handle > BUFLIB_MT_HANDLE_MASK)
+    {
+        buflib_free(&part->ctx, handle);
+        return 0;
+    }
+    return (int)(part - mt->parts) << BUFLIB_MT_CONTEXT_SHIFT | handle;
+}
+
+/* Free a handle from any thread */
+void
+buflib_mt_free(struct buflib_mt_context *mt, int handle)
+{
+    struct buflib_mt_part *part = &mt->parts[handle >> BUFLIB_MT_CONTEXT_SHIFT];
+    handle &= BUFLIB_MT_HANDLE_MASK;
+    if (part == this_part(mt) || !remote_push(part, handle))
+        buflib_free(&part->ctx, handle);
+}
+
+bool
+buflib_mt_shrink(struct buflib_mt_context *mt, int handle,
+                 void* new_start, size_t new_size)
+{
+    return buflib_shrink(buflib_mt_context_of(mt, handle),
+                         handle & BUFLIB_MT_HANDLE_MASK, new_start, new_size);
+}
+
+bool
+buflib_mt_realloc(struct buflib_mt_context *mt, int handle, size_t new_size)
+{
+    return buflib_realloc(buflib_mt_context_of(mt, handle),
+                          handle & BUFLIB_MT_HANDLE_MASK, new_size);
+}
+
+/* Free what other threads have queued for any of the contexts, e.g. for a
+ * context whose owner stopped allocating */
+void
+buflib_mt_drain(struct buflib_mt_context *mt)
+{
+    int i;
+    for (i = 0; i < mt->num_contexts; i++)
+    {
+        struct buflib_mt_part *part = &mt->parts[i];
+        buflib_lock(&part->ctx);
+        remote_drain(part);
+        buflib_unlock(&part->ctx);
+    }
+}
+
+#endif /* BUFLIB_HAVE_THREADS */
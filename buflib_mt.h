@@ -0,0 +1,84 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Front end that splits one buffer into a buflib context per thread.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#ifndef _BUFLIB_MT_H_
+#define _BUFLIB_MT_H_
+
+#include "buflib.h"
+#include "new_apis.h"
+
+#ifdef BUFLIB_HAVE_THREADS
+
+#define BUFLIB_MT_MAX_CONTEXTS 64
+/* the context index is kept in the handle bits above the context's own
+ * handle, which leaves room for 16M handles per context */
+#define BUFLIB_MT_CONTEXT_SHIFT 24
+#define BUFLIB_MT_HANDLE_MASK ((1 << BUFLIB_MT_CONTEXT_SHIFT) - 1)
+/* frees from other threads waiting for the owner, per context */
+#define BUFLIB_MT_REMOTE_FREES 256
+
+struct buflib_mt_remote
+{
+    unsigned long seq;
+    int handle;
+};
+
+struct buflib_mt_part
+{
+    struct buflib_context ctx;
+    /* bounded queue of handles freed by other threads, any thread may add to
+     * it, it's emptied with ctx locked */
+    unsigned long remote_head;
+    unsigned long remote_tail;
+    struct buflib_mt_remote remote[BUFLIB_MT_REMOTE_FREES];
+} __attribute__((aligned(64)));
+
+struct buflib_mt_context
+{
+    struct buflib_mt_part parts[BUFLIB_MT_MAX_CONTEXTS];
+    int num_contexts;
+};
+
+void buflib_mt_init(struct buflib_mt_context *mt, void *buf, size_t size,
+                    int num_contexts);
+int buflib_mt_alloc_ex(struct buflib_mt_context *mt, size_t size,
+                       const char *name, struct buflib_callbacks *ops);
+void buflib_mt_free(struct buflib_mt_context *mt, int handle);
+bool buflib_mt_shrink(struct buflib_mt_context *mt, int handle,
+                      void* new_start, size_t new_size);
+bool buflib_mt_realloc(struct buflib_mt_context *mt, int handle,
+                       size_t new_size);
+void buflib_mt_drain(struct buflib_mt_context *mt);
+
+static inline struct buflib_context*
+buflib_mt_context_of(struct buflib_mt_context *mt, int handle)
+{
+    return &mt->parts[handle >> BUFLIB_MT_CONTEXT_SHIFT].ctx;
+}
+
+static inline void* buflib_mt_get_data(struct buflib_mt_context *mt, int handle)
+{
+    return buflib_get_data(buflib_mt_context_of(mt, handle),
+                           handle & BUFLIB_MT_HANDLE_MASK);
+}
+
+#endif /* BUFLIB_HAVE_THREADS */
+#endif /* _BUFLIB_MT_H_ */
@@ -0,0 +1,185 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Slabs of same-size objects, each slab a movable buflib allocation.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#include "buflib_slab.h"
+
+/* Many tiny allocations each pay for a handle and a block header, and each
+ * is moved on its own by compaction. A slab packs objects of one size into a
+ * single allocation instead, the objects themselves have no header at all.
+ *
+ * Objects are referred to by the index of their slab and their index in it,
+ * rather than by pointer, so references don't change when compaction moves
+ * a slab, and the move callback has nothing to update. Free objects of a
+ * slab are linked by index through their first bytes, objects past "fresh"
+ * were never used and need no linking. A slab that becomes empty is freed,
+ * unless it's the one allocations are served from.
+ *
+ * The slab layer keeps its state outside of the buffer and locks the
+ * context around changing it, so it's as thread safe as the context.
+ */
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks slab_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+/* Set up slab for objects of obj_size bytes, per_slab of them in each buflib
+ * allocation (0 for as many as fit into BUFLIB_SLAB_SIZE) */
+void
+buflib_slab_init(struct buflib_slab *slab, struct buflib_context *ctx,
+                 size_t obj_size, unsigned per_slab, const char *name)
+{
+    /* objects hold a link when free, and may hold pointers when used */
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+    obj_size = ALIGN_UP(obj_size, sizeof(void*));
+    if (!per_slab)
+        per_slab = BUFLIB_SLAB_SIZE / obj_size;
+    if (per_slab < 1)
+        per_slab = 1;
+    if (per_slab >= BUFLIB_SLAB_NONE)
+        per_slab = BUFLIB_SLAB_NONE - 1;
+    slab->ctx = ctx;
+    slab->name = name;
+    slab->obj_size = obj_size;
+    slab->per_slab = per_slab;
+    slab->current = 0;
+    slab->num_slabs = 0;
+}
+
+static inline bool
+slab_has_room(struct buflib_slab *slab, struct buflib_slab_info *info)
+{
+    return info->handle > 0 && info->used < slab->per_slab;
+}
+
+/* Find a slab with a free object, allocating a new one if needed. Returns
+ * its index or -1 */
+static int
+slab_find(struct buflib_slab *slab)
+{
+    int i, unused = -1;
+    if (slab->current < slab->num_slabs
+            && slab_has_room(slab, &slab->slabs[slab->current]))
+        return slab->current;
+    for (i = 0; i < slab->num_slabs; i++)
+    {
+        if (slab_has_room(slab, &slab->slabs[i]))
+            return i;
+        if (slab->slabs[i].handle <= 0 && unused < 0)
+            unused = i;
+    }
+    if (unused < 0)
+    {
+        if (slab->num_slabs == BUFLIB_SLAB_MAX)
+            return -1;
+        unused = slab->num_slabs;
+    }
+
+    int handle = buflib_alloc_ex(slab->ctx, slab->per_slab * slab->obj_size,
+                                 slab->name, &slab_ops);
+    if (handle <= 0)
+        return -1;
+    struct buflib_slab_info *info = &slab->slabs[unused];
+    info->handle = handle;
+    info->used = 0;
+    info->free = BUFLIB_SLAB_NONE;
+    info->fresh = 0;
+    if (unused == slab->num_slabs)
+        slab->num_slabs++;
+    return unused;
+}
+
+/* Allocate an object, returning a reference for buflib_slab_get() and
+ * buflib_slab_free(), or 0 if there's no room */
+int
+buflib_slab_alloc(struct buflib_slab *slab)
+{
+    int s, obj;
+    buflib_lock(slab->ctx);
+    s = slab_find(slab);
+    if (s < 0)
+    {
+        buflib_unlock(slab->ctx);
+        return 0;
+    }
+    struct buflib_slab_info *info = &slab->slabs[s];
+    if (info->free != BUFLIB_SLAB_NONE)
+    {
+        obj = info->free;
+        char *data = buflib_get_data(slab->ctx, info->handle);
+        info->free = *(uint16_t*)(data + obj * slab->obj_size);
+    }
+    else
+        obj = info->fresh++;
+    info->used++;
+    slab->current = s;
+    buflib_unlock(slab->ctx);
+    return (s + 1) << BUFLIB_SLAB_OBJ_BITS | obj;
+}
+
+void
+buflib_slab_free(struct buflib_slab *slab, int ref)
+{
+    int s = (ref >> BUFLIB_SLAB_OBJ_BITS) - 1, obj = ref & BUFLIB_SLAB_OBJ_MASK;
+    buflib_lock(slab->ctx);
+    struct buflib_slab_info *info = &slab->slabs[s];
+    if (--info->used == 0)
+    {
+        if (s != slab->current)
+        {
+            buflib_free(slab->ctx, info->handle);
+            info->handle = 0;
+        }
+        else
+        {   /* start over, no need to link the objects */
+            info->free = BUFLIB_SLAB_NONE;
+            info->fresh = 0;
+        }
+    }
+    else
+    {
+        char *data = buflib_get_data(slab->ctx, info->handle);
+        *(uint16_t*)(data + obj * slab->obj_size) = info->free;
+        info->free = obj;
+    }
+    buflib_unlock(slab->ctx);
+}
+
+/* Free all slabs, references of slab mustn't be used anymore */
+void
+buflib_slab_destroy(struct buflib_slab *slab)
+{
+    int i;
+    buflib_lock(slab->ctx);
+    for (i = 0; i < slab->num_slabs; i++)
+        if (slab->slabs[i].handle > 0)
+            buflib_free(slab->ctx, slab->slabs[i].handle);
+    slab->num_slabs = 0;
+    slab->current = 0;
+    buflib_unlock(slab->ctx);
+}
@@ -0,0 +1,71 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* Slabs of same-size objects, each slab a movable buflib allocation.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+#ifndef _BUFLIB_SLAB_H_
+#define _BUFLIB_SLAB_H_
+
+#include "buflib.h"
+#include "new_apis.h"
+
+#define BUFLIB_SLAB_MAX 256
+/* default size of a slab in bytes */
+#define BUFLIB_SLAB_SIZE 4096
+/* a reference is the slab index plus one above the object index */
+#define BUFLIB_SLAB_OBJ_BITS 16
+#define BUFLIB_SLAB_OBJ_MASK ((1 << BUFLIB_SLAB_OBJ_BITS) - 1)
+/* end of a free list */
+#define BUFLIB_SLAB_NONE BUFLIB_SLAB_OBJ_MASK
+
+struct buflib_slab_info
+{
+    int handle;         /* 0 if the slab isn't allocated */
+    uint16_t used;      /* objects handed out */
+    uint16_t free;      /* first free object, linked through the objects */
+    uint16_t fresh;     /* objects from here on were never handed out */
+};
+
+struct buflib_slab
+{
+    struct buflib_context *ctx;
+    const char *name;
+    size_t obj_size;
+    unsigned per_slab;
+    int current;        /* the slab allocated from last */
+    int num_slabs;      /* slabs[] entries in use, some may be unallocated */
+    struct buflib_slab_info slabs[BUFLIB_SLAB_MAX];
+};
+
+void buflib_slab_init(struct buflib_slab *slab, struct buflib_context *ctx,
+                      size_t obj_size, unsigned per_slab, const char *name);
+int buflib_slab_alloc(struct buflib_slab *slab);
+void buflib_slab_free(struct buflib_slab *slab, int ref);
+void buflib_slab_destroy(struct buflib_slab *slab);
+
+/* Get the object of a reference. Like with buflib_get_data(), the pointer
+ * is only valid until the context is compacted */
+static inline void* buflib_slab_get(struct buflib_slab *slab, int ref)
+{
+    char *data = buflib_get_data(slab->ctx,
+                    slab->slabs[(ref >> BUFLIB_SLAB_OBJ_BITS) - 1].handle);
+    return data + (ref & BUFLIB_SLAB_OBJ_MASK) * slab->obj_size;
+}
+
+#endif /* _BUFLIB_SLAB_H_ */
@@ -11,6 +11,13 @@ void buflib_core_init(void)
     buflib_init(&core_ctx, buf, sizeof(buf));
 }
 
+#ifdef BUFLIB_HAVE_VM
+bool buflib_core_init_growable(size_t max_size)
+{
+    return buflib_init_growable(&core_ctx, sizeof(buf), max_size);
+}
+#endif
+
 int core_alloc(const char* name, size_t size)
 {
     return buflib_alloc_ex(&core_ctx, size, name, NULL);
@@ -21,6 +28,12 @@ int core_alloc_ex(const char* name, size_t size, struct buflib_callbacks *ops)
     return buflib_alloc_ex(&core_ctx, size, name, ops);
 }
 
+int core_alloc_flags(const char* name, size_t size,
+                     struct buflib_callbacks *ops, unsigned flags)
+{
+    return buflib_alloc_flags(&core_ctx, size, name, ops, flags);
+}
+
 size_t core_available(void)
 {
     return buflib_available(&core_ctx);
@@ -46,6 +59,36 @@ bool core_shrink(int handle, void* new_start, size_t new_size)
     return buflib_shrink(&core_ctx, handle, new_start, new_size);
 }
 
+bool core_realloc(int handle, size_t new_size)
+{
+    return buflib_realloc(&core_ctx, handle, new_size);
+}
+
+bool core_compact_step(size_t max_bytes)
+{
+    return buflib_compact_step(&core_ctx, max_bytes);
+}
+
+bool core_snapshot(int fd)
+{
+    return buflib_snapshot(&core_ctx, fd);
+}
+
+bool core_restore(int fd, struct buflib_callbacks* (*get_ops)(const char *name))
+{
+    return buflib_restore(&core_ctx, fd, get_ops);
+}
+
+void core_pin(int handle)
+{
+    buflib_pin(&core_ctx, handle);
+}
+
+void core_unpin(int handle)
+{
+    buflib_unpin(&core_ctx, handle);
+}
+
 void core_print_allocs(void)
 {
     buflib_print_allocs(&core_ctx);
@@ -25,19 +25,23 @@
 
 const char* buflib_get_name(struct buflib_context *ctx, int handle)
 {
+    const char *name = NULL;
+    buflib_lock(ctx);
     union buflib_data *data = (union buflib_data*)ALIGN_DOWN((intptr_t)buflib_get_data(ctx, handle), sizeof (*data));
-    size_t len = data[-1].val;
-    if (len <= 1)
-        return NULL;
-    return data[-len].name;
+    unsigned id = BUFLIB_BLOCK_INFO(data - BUFLIB_HEADER) & BUFLIB_NAME_ID_MASK;
+    if (id)
+        name = ctx->names.strings + id - 1;
+    buflib_unlock(ctx);
+    return name;
 }
 
 void buflib_print_allocs(struct buflib_context *ctx)
 {
     union buflib_data *this, *end = ctx->handle_table;
+    buflib_lock(ctx);
     for(this = end - 1; this >= ctx->last_handle; this--)
     {
-        if (!this->alloc) continue;
+        if (buflib_handle_is_free(ctx, this)) continue;
 
         int handle_num;
         const char *name;
@@ -47,7 +51,7 @@ void buflib_print_allocs(struct buflib_context *ctx)
         handle_num = end - this;
         alloc_start = buflib_get_data(ctx, handle_num);
         name = buflib_get_name(ctx, handle_num);
-        block_start = (union buflib_data*)name - 3;
+        block_start = (union buflib_data*)ALIGN_DOWN((intptr_t)alloc_start, sizeof (union buflib_data)) - BUFLIB_HEADER;
         alloc_len = block_start->val * sizeof(union buflib_data);
 
         printf("%s(%d):\t%0p\n"
@@ -55,17 +59,20 @@ void buflib_print_allocs(struct buflib_context *ctx)
                "   \t%ld\n",
                name?:"(null)", handle_num, block_start, alloc_start, alloc_len);
     }
+    buflib_unlock(ctx);
 }
 
 void buflib_print_blocks(struct buflib_context *ctx)
 {
+    buflib_lock(ctx);
     for(union buflib_data* this = ctx->buf_start;
                            this < ctx->alloc_end;
                            this += abs(this->val))
     {
-        char buf[128] = { 0 };
+        unsigned id = this->val > 0 ? BUFLIB_BLOCK_INFO(this) & BUFLIB_NAME_ID_MASK : 0;
         printf("%08p: val: %4d (%s)\n",
                         this, this->val,
-                        this->val > 0? this[3].name:"<unallocated>");
+                        this->val > 0? (id ? ctx->names.strings + id - 1 : "(null)"):"<unallocated>");
     }
+    buflib_unlock(ctx);
 }
@@ -29,10 +29,25 @@
 const char* buflib_get_name(struct buflib_context *ctx, int handle);
 int buflib_alloc_ex(struct buflib_context *ctx, size_t size, const char *name,
                     struct buflib_callbacks *ops);
+int buflib_alloc_flags(struct buflib_context *ctx, size_t size, const char *name,
+                       struct buflib_callbacks *ops, unsigned flags);
 void buflib_print_allocs(struct buflib_context *ctx);
 void buflib_print_blocks(struct buflib_context *ctx);
 size_t buflib_available(struct buflib_context *ctx);
 int buflib_alloc_maximum(struct buflib_context* ctx, const char* name, size_t *size, struct buflib_callbacks *ops);
 bool buflib_shrink(struct buflib_context *ctx, int handle, void* newstart, size_t new_size);
+bool buflib_realloc(struct buflib_context *ctx, int handle, size_t new_size);
+bool buflib_compact_step(struct buflib_context *ctx, size_t max_bytes);
+size_t buflib_fragmented(struct buflib_context *ctx);
+void buflib_get_stats(struct buflib_context *ctx, struct buflib_stats *stats);
+#ifdef BUFLIB_HAVE_TRACE
+void buflib_trace_start(struct buflib_context *ctx, FILE *file);
+void buflib_trace_stop(struct buflib_context *ctx);
+#endif
+bool buflib_snapshot(struct buflib_context *ctx, int fd);
+bool buflib_restore(struct buflib_context *ctx, int fd,
+                    struct buflib_callbacks* (*get_ops)(const char *name));
+void buflib_pin(struct buflib_context *ctx, int handle);
+void buflib_unpin(struct buflib_context *ctx, int handle);
 struct buflib_callbacks* buflib_default_callbacks(void);
 #endif /* __NEW_APIS_H__ */
@@ -14,6 +14,15 @@
  */
 void buflib_core_init(void);
 
+/**
+ * Initializes buflib like buflib_core_init(), but with a pool that grows
+ * when it runs out of memory instead of failing allocations, up to
+ * max_size bytes (not for Rockbox)
+ *
+ * Returns: false if the address space couldn't be reserved
+ */
+bool buflib_core_init_growable(size_t max_size);
+
 /**
  * Allocates memory from the core's memory pool
  *
@@ -26,11 +35,9 @@ int core_alloc(const char* name, size_t size);
 
 /**
  * Allocates memory from the core's memory pool with additional callbacks
- * and flags
  * 
  * name: A string identifier giving this allocation a name
  * size: How many bytes to allocate
- * flags: Flags giving information how this allocation needs to be handled (see below)
  * ops: a struct with pointers to callback functions (see below)
  *
  * Returns: An integer handle identifying this allocation
@@ -38,6 +45,34 @@ int core_alloc(const char* name, size_t size);
 struct buflib_callbacks;
 int core_alloc_ex(const char* name, size_t size, struct buflib_callbacks *ops);
 
+/**
+ * Flags for core_alloc_flags(), giving information how an allocation is
+ * going to be used, so that it can be placed where it fragments the pool
+ * the least
+ */
+/* Stays allocated for a long time, or for good */
+#define BUFLIB_ALLOC_LONG_LIVED  (1<<0)
+/* Can't be moved, the ops have no move callback */
+#define BUFLIB_ALLOC_UNMOVABLE   (1<<1)
+/* Is freed again soon */
+#define BUFLIB_ALLOC_SHORT_LIVED (1<<2)
+
+/**
+ * Allocates memory like core_alloc_ex(), with flags
+ *
+ * Long lived and unmovable allocations are kept together at the start of
+ * the pool, where they don't split up the space compaction works on.
+ * Movable allocations may be moved to make room for them. Short lived ones
+ * are put at the end of the allocated memory rather than into gaps between
+ * allocations. Without flags, allocations are placed wherever they fit.
+ *
+ * flags: BUFLIB_ALLOC_* flags
+ *
+ * Returns: An integer handle identifying this allocation
+ */
+int core_alloc_flags(const char* name, size_t size,
+                     struct buflib_callbacks *ops, unsigned flags);
+
 
 /**
  * Queries the data pointer for the given handle. It's actually a cheap operation,
@@ -70,6 +105,7 @@ void core_free(int handle);
  * MUST_NOT_MOVE buflib will move the allocation before even attempting to
  * shrink.
  */
+struct buflib_move;
 struct buflib_callbacks {
     /**
      * This is called before data is moved. Use this to fix up any pointers
@@ -82,6 +118,10 @@ struct buflib_callbacks {
      * Return: Return BUFLIB_CB_OK, or BUFLIB_CB_CANNOT_MOVE if movement
      * is impossible at this moment.
      *
+     * Adjacent allocations are moved together once each of them was told,
+     * until then core_get_data() returns their old start, where the data
+     * still is.
+     *
      * If NULL: this allocation must not be moved around by the buflib when
      * compation occurs
      */
@@ -105,8 +145,44 @@ struct buflib_callbacks {
      * at least shrinkable
      */
     int (*shrink_callback)(int handle, unsigned hints, void* start, size_t old_size);
+    /**
+     * Optional, replaces move_callback for owners of many allocations that
+     * reference each other. Instead of once per allocation it's called for
+     * batches of (up to 16) allocations of this owner, so that all pointers
+     * can be fixed up in one go.
+     *
+     * phase: BUFLIB_MOVE_PREPARE before any allocation of the batch is moved,
+     * new is NULL in all entries then.
+     * BUFLIB_MOVE_DONE after the data has been moved, with only the
+     * allocations that were actually moved in moves
+     * moves: The batch, sorted by address
+     * count: The number of entries in moves
+     *
+     * Return: BUFLIB_CB_OK, or BUFLIB_CB_CANNOT_MOVE in the prepare phase
+     * if none of the allocations can be moved at this moment. Ignored in the
+     * done phase
+     */
+    int (*move_batch_callback)(int phase, struct buflib_move *moves, int count);
+    /**
+     * How expensive shrinking is for this owner. When an allocation needs
+     * shrinking, allocations with a lower cost are asked first, and no more
+     * are asked once enough was freed. 0 (the default) is the cheapest
+     */
+    unsigned shrink_cost;
+};
+
+/**
+ * A moved allocation, as passed to move_batch_callback
+ */
+struct buflib_move {
+    int handle;
+    void* old; /* start of the allocation before moving */
+    void* new; /* start of the allocation after moving */
 };
 
+#define BUFLIB_MOVE_PREPARE 0
+#define BUFLIB_MOVE_DONE    1
+
 #define BUFLIB_SHRINK_POS_MASK ((1<<0|1<<1)<<30)
 #define BUFLIB_SHRINK_SIZE_MASK (~BUFLIB_SHRINK_POS_MASK)
 #define BUFLIB_SHRINK_POS_FRONT (1u<<31)
@@ -162,6 +238,23 @@ int core_alloc_maximum(const char* name, size_t *size, struct buflib_callbacks *
  */
 bool core_shrink(int handle, void* new_start, size_t new_size);
 
+/**
+ * Resizes the memory allocation associated with the given handle, keeping
+ * the handle. Unlike core_shrink() it can grow allocations: in place if
+ * enough free memory follows the allocation (possibly after compaction),
+ * by copying the data to a new location otherwise. Pinned allocations are
+ * only grown in place.
+ *
+ * handle: The handle identifying this allocation
+ * new_size: the new size of the allocation, counted from the current start
+ * of its data. The data up to the smaller of the old and new size is kept
+ *
+ * Returns: true if resizing was successful, core_get_data() must be called
+ * again as the data may have moved. Otherwise it returns false, without
+ * having modified memory.
+ */
+bool core_realloc(int handle, size_t new_size);
+
 /**
  * Returns how many bytes left the buflib has to satisfy allocations (not
  * accounting possible compaction)
@@ -171,6 +264,57 @@ bool core_shrink(int handle, void* new_start, size_t new_size);
  */
 size_t core_available(void);
 
+/**
+ * Compacts the memory pool a bit at a time, so that fragmentation can be dealt
+ * with when idle instead of within the allocation that runs out of memory.
+ * Allocations are moved (calling their move_callback) until max_bytes have
+ * been moved, the next call resumes where this one stopped. Allocating and
+ * freeing in between is fine.
+ *
+ * max_bytes: How many bytes to move at most, 0 for no limit. A single
+ * allocation bigger than this is still moved in one go
+ *
+ * Returns: true once the pool is compact, false if more calls are needed
+ */
+bool core_compact_step(size_t max_bytes);
+
+/**
+ * Pins an allocation, so that compaction neither moves nor shrinks it until
+ * it's unpinned again. Meanwhile its data can be used through a plain pointer
+ * without move or shrink callbacks. Pins nest, every core_pin() needs a
+ * matching core_unpin().
+ *
+ * handle: The handle of the allocation to pin or unpin
+ */
+void core_pin(int handle);
+void core_unpin(int handle);
+
+/**
+ * Saves all allocations to a file, so that a later run can bring them back
+ * with core_restore() instead of building them up again.
+ *
+ * fd: An open file to write the snapshot to
+ *
+ * Returns: true if the snapshot was written completely
+ */
+bool core_snapshot(int fd);
+
+/**
+ * Brings back the allocations of a snapshot written by core_snapshot(). It
+ * must be called before anything is allocated. The handles are the same as
+ * when the snapshot was taken. If the pool isn't at the same address, the
+ * move_callback of each allocation is called to fix up its pointers, with
+ * current being where the allocation was and the data at new already.
+ *
+ * fd: An open file to read the snapshot from
+ * get_ops: Gives the callbacks of the allocations by their name, NULL for
+ * the default ones
+ *
+ * Returns: true if the allocations were restored. Otherwise nothing is
+ * allocated, and the allocations need to be built up again
+ */
+bool core_restore(int fd, struct buflib_callbacks* (*get_ops)(const char *name));
+
 /**
  * Prints an overview of all current allocations to stdout (not for Rockbox)
  */
@@ -184,7 +328,10 @@ void core_print_blocks(void);
  *
  * handle: The handle indicating the allocation
  *
- * Returns: A pointer to the string identifier of the allocation
+ * Returns: A pointer to the string identifier of the allocation. Names are
+ * kept once for all allocations with the same one, in a table of limited
+ * size (BUFLIB_NAME_SPACE). NULL if the allocation has no name, or the table
+ * was full when it was allocated.
  */
 const char* core_get_alloc_name(int handle);
 #endif /* __PROPOSED_API_H__ */
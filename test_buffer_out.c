@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Handing out and taking back buffer space moves the allocations, but the
+ * handle table entries stay the same.
+ *
+ * Expected output:
+-------------------
+handed out 2000 bytes, handles unchanged
+data intact
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+int main(void)
+{
+    union buflib_data entries[10];
+    char name[8];
+    int handles[10], i;
+    size_t size = 2000;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < 10; i++)
+    {
+        handles[i] = buflib_alloc(&ctx, 100);
+        snprintf(name, sizeof(name), "h%d", i);
+        strcpy(buflib_get_data(&ctx, handles[i]), name);
+    }
+    buflib_free(&ctx, handles[3]);
+    handles[3] = 0;
+    memcpy(entries, ctx.last_handle, sizeof(entries));
+
+    if (buflib_buffer_out(&ctx, &size) != buflib_buffer)
+        error("not handed out from the start\n");
+    if (memcmp(entries, ctx.last_handle, sizeof(entries)))
+        error("handle table changed\n");
+    printf("handed out %zu bytes, handles unchanged\n", size);
+    buflib_buffer_in(&ctx, size);
+
+    for (i = 0; i < 10; i++)
+    {
+        snprintf(name, sizeof(name), "h%d", i);
+        if (handles[i] && strcmp(buflib_get_data(&ctx, handles[i]), name))
+            error("%s lost\n", name);
+    }
+    printf("data intact\n");
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "proposed-api.h"
+
+/*
+ * Compacts a fragmented pool in steps of at most 4KiB, then checks
+ * that a big allocation fits without further compaction.
+ *
+ * Expected output (64-bit):
+-------------------
+available before: 2200
+step 1 moved 3 blocks
+step 2 moved 3 blocks
+step 3 moved 3 blocks
+step 4 moved 3 blocks
+step 5 moved 3 blocks
+step 6 moved 3 blocks
+compact after 6 steps
+available after: 26520
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+static int moves;
+static int move_callback(int handle, void* old, void* new)
+{
+    (void)handle;(void)old;(void)new;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+#define NUM 40
+int main(void)
+{
+    int handles[NUM], i, steps = 0;
+    buflib_core_init();
+
+    for (i = 0; i < NUM; i++)
+    {
+        handles[i] = core_alloc_ex("chunk", 1200, &ops);
+        if (handles[i] <= 0) error("alloc %d failed\n", i);
+        memset(core_get_data(handles[i]), i, 1200);
+    }
+    for (i = 0; i < NUM; i += 2)
+        core_free(handles[i]);
+
+    printf("available before: %zu\n", core_available());
+    while (!core_compact_step(4<<10))
+    {
+        /* no more than 3 blocks of ~1.2K fit into 4K */
+        if (moves > 3) error("step %d moved %d blocks\n", steps, moves);
+        printf("step %d moved %d blocks\n", ++steps, moves);
+        moves = 0;
+    }
+    printf("compact after %d steps\n", steps);
+    printf("available after: %zu\n", core_available());
+
+    for (i = 1; i < NUM; i += 2)
+    {
+        unsigned char *data = core_get_data(handles[i]);
+        if (data[0] != i || data[1199] != i) error("data of %d corrupt\n", i);
+    }
+
+    moves = 0;
+    int big = core_alloc("big", 20<<10);
+    if (big <= 0) error("big failed\n");
+    if (moves) error("big alloc compacted again\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Frees every other allocation and lets the background compactor gather the
+ * free space, so that a following big allocation doesn't need to move
+ * anything itself.
+ *
+ * Expected output (64-bit):
+-------------------
+fragmented: 19456
+fragmented: 0
+big alloc didn't compact
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (48<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static struct buflib_compactor compactor;
+static volatile int moves;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+#define NUM 32
+int main(void)
+{
+    int handles[NUM], i;
+    buflib_init_locked(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < NUM; i++)
+    {
+        handles[i] = buflib_alloc_ex(&ctx, 1200, "chunk", &ops);
+        if (handles[i] <= 0) error("alloc %d failed\n", i);
+    }
+
+    /* free half of it before the compactor runs, it picks that up. It can't
+     * start before the lock is released */
+    for (i = 0; i < NUM/2; i += 2)
+        buflib_free(&ctx, handles[i]);
+    buflib_lock(&ctx);
+    if (!buflib_compactor_start(&compactor, &ctx, 8<<10, 4<<10))
+        error("compactor didn't start\n");
+    for (i = NUM/2; i < NUM; i += 2)
+        buflib_free(&ctx, handles[i]);
+    printf("fragmented: %zu\n", buflib_fragmented(&ctx));
+    buflib_unlock(&ctx);
+
+    for (i = 0; i < 1000 && buflib_fragmented(&ctx) > 0; i++)
+        usleep(1000);
+    printf("fragmented: %zu\n", buflib_fragmented(&ctx));
+    buflib_compactor_stop(&compactor);
+
+    moves = 0;
+    int big = buflib_alloc_ex(&ctx, 20<<10, "big", &ops);
+    if (big <= 0) error("big alloc failed\n");
+    if (moves) error("big alloc compacted\n");
+    printf("big alloc didn't compact\n");
+    return 0;
+}
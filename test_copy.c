@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib_copy.h"
+
+/*
+ * Big moves bypassing the cache give the same result as memmove(), also
+ * for overlapping and unaligned ranges.
+ *
+ * Expected output:
+-------------------
+moves ok
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define SIZE (BUFLIB_STREAM_MIN * 4)
+static char buf[SIZE], ref[SIZE];
+
+static void fill(void)
+{
+    size_t i;
+    for (i = 0; i < SIZE; i++)
+        buf[i] = ref[i] = i * 7 + i / 251;
+}
+
+int main(void)
+{
+    long shifts[] = { -1, -16, -61, -4096, 1, 16, 61, 4096,
+                      BUFLIB_STREAM_MIN + 3, -BUFLIB_STREAM_MIN - 3 };
+    size_t sizes[] = { 0, 63, BUFLIB_STREAM_MIN, BUFLIB_STREAM_MIN + 77 };
+    size_t i, j;
+    for (i = 0; i < sizeof(shifts)/sizeof(shifts[0]); i++)
+    {
+        for (j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++)
+        {
+            /* source in the middle, unaligned */
+            char *src = buf + BUFLIB_STREAM_MIN * 3 / 2 + 5;
+            fill();
+            buflib_move_stream(src + shifts[i], src, sizes[j]);
+            memmove(ref + (src - buf) + shifts[i], ref + (src - buf), sizes[j]);
+            if (memcmp(buf, ref, SIZE))
+                error("move of %zu bytes by %ld differs\n", sizes[j], shifts[i]);
+        }
+    }
+    printf("moves ok\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Fixed allocations gather at the start of the buffer, moving a movable one
+ * out of their way. Short lived allocations go to the end instead of into
+ * the holes that are left.
+ *
+ * Expected output:
+-------------------
+long lived placed after the first, movable moved 1 times
+unmovable placed after them, movable moved 2 times
+short lived at the end, others in the hole
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static int moves;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static char* data(int handle)
+{
+    return buflib_get_data(&ctx, handle);
+}
+
+int main(void)
+{
+    int a, b, c, m, s, t;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    a = buflib_alloc_flags(&ctx, 1000, "a", NULL, BUFLIB_ALLOC_UNMOVABLE);
+    m = buflib_alloc_ex(&ctx, 1000, "m", &ops);
+    strcpy(data(m), "movable");
+    b = buflib_alloc_flags(&ctx, 500, "b", &ops, BUFLIB_ALLOC_LONG_LIVED);
+    if (data(a) > data(b) || data(b) > data(m))
+        error("b isn't between a and m\n");
+    printf("long lived placed after the first, movable moved %d times\n", moves);
+
+    /* bigger than the space m leaves and what's behind m */
+    c = buflib_alloc_flags(&ctx, 3000, "c", NULL, BUFLIB_ALLOC_UNMOVABLE);
+    if (data(b) > data(c) || data(c) > data(m) || strcmp(data(m), "movable"))
+        error("c isn't between b and m\n");
+    printf("unmovable placed after them, movable moved %d times\n", moves);
+
+    buflib_free(&ctx, b);
+    s = buflib_alloc_flags(&ctx, 100, "s", NULL, BUFLIB_ALLOC_SHORT_LIVED);
+    t = buflib_alloc(&ctx, 100);
+    if (data(s) < data(m) || data(t) > data(c))
+        error("s isn't at the end or t isn't in the hole\n");
+    printf("short lived at the end, others in the hole\n");
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * A growable context commits more memory when it runs out, keeping handles
+ * and data, until it reaches its maximum size.
+ *
+ * Expected output:
+-------------------
+1000 allocations, grew: yes
+data intact
+too big: failed
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+static struct buflib_context ctx;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+int main(void)
+{
+    struct buflib_stats stats;
+    int handles[1000], i;
+    if (!buflib_init_growable(&ctx, 16<<10, 4<<20))
+        error("can't reserve\n");
+
+    for (i = 0; i < 1000; i++)
+    {
+        handles[i] = buflib_alloc_ex(&ctx, 1000, "grow", i % 2 ? &ops : NULL);
+        if (handles[i] <= 0)
+            error("alloc %d failed\n", i);
+        memset(buflib_get_data(&ctx, handles[i]), i, 1000);
+    }
+    buflib_get_stats(&ctx, &stats);
+    printf("1000 allocations, grew: %s\n", stats.grows ? "yes" : "no");
+
+    for (i = 0; i < 1000; i += 2)
+        buflib_free(&ctx, handles[i]);
+    for (i = 1; i < 1000; i += 2)
+    {
+        unsigned char *data = buflib_get_data(&ctx, handles[i]);
+        if (data[0] != (unsigned char)i || data[999] != (unsigned char)i)
+            error("data of %d lost\n", i);
+    }
+    printf("data intact\n");
+
+    printf("too big: %s\n", buflib_alloc(&ctx, 4<<20) > 0 ? "ok" : "failed");
+    buflib_release(&ctx);
+    return 0;
+}
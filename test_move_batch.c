@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "proposed-api.h"
+
+/*
+ * A linked list whose nodes are separate allocations, fixed up by a
+ * move_batch_callback after compaction moved them.
+ *
+ * Expected output (64-bit):
+-------------------
+prepare 16, done 16
+prepare 14, done 14
+list ok
+vetoed 16
+vetoed 14
+list ok
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define NODES 30
+struct node {
+    struct node *next;
+    int index;
+};
+static int nodes[NODES];
+static bool veto;
+
+static int batch_callback(int phase, struct buflib_move *moves, int count)
+{
+    int i, j;
+    if (phase == BUFLIB_MOVE_PREPARE)
+    {
+        if (veto)
+        {
+            printf("vetoed %d\n", count);
+            return BUFLIB_CB_CANNOT_MOVE;
+        }
+        printf("prepare %d, ", count);
+        return BUFLIB_CB_OK;
+    }
+    printf("done %d\n", count);
+    /* the data is at the new place now, fix up all links at once */
+    for (i = 0; i < NODES; i++)
+    {
+        struct node *n = core_get_data(nodes[i]);
+        for (j = 0; j < count; j++)
+            if (n->next == moves[j].old)
+                n->next = moves[j].new;
+    }
+    return BUFLIB_CB_OK;
+}
+
+static int move_callback(int handle, void* old, void* new)
+{
+    (void)handle;(void)old;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+struct buflib_callbacks list_ops = {
+    .move_callback = NULL,
+    .shrink_callback = NULL,
+    .move_batch_callback = batch_callback,
+};
+
+struct buflib_callbacks filler_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static void check_list(void)
+{
+    struct node *n = core_get_data(nodes[0]);
+    int i;
+    for (i = 0; i < NODES; i++, n = n->next)
+    {
+        if (n != core_get_data(nodes[i]) || n->index != i)
+            error("list broken at %d\n", i);
+    }
+    printf("list ok\n");
+}
+
+int main(void)
+{
+    int fillers[NODES], i;
+    void *before[NODES];
+    buflib_core_init();
+
+    for (i = 0; i < NODES; i++)
+    {
+        fillers[i] = core_alloc_ex("filler", 800, &filler_ops);
+        nodes[i] = core_alloc_ex("node", 500, &list_ops);
+        if (fillers[i] <= 0 || nodes[i] <= 0) error("alloc %d failed\n", i);
+        ((struct node*)core_get_data(nodes[i]))->index = i;
+        if (i > 0)
+            ((struct node*)core_get_data(nodes[i-1]))->next = core_get_data(nodes[i]);
+    }
+    ((struct node*)core_get_data(nodes[NODES-1]))->next = NULL;
+
+    for (i = 0; i < NODES; i++)
+        core_free(fillers[i]);
+    /* needs compaction, moving every node */
+    int big = core_alloc("big", 20<<10);
+    if (big <= 0) error("big failed\n");
+    check_list();
+
+    /* when vetoed, none of the nodes may move */
+    core_free(big);
+    core_free(nodes[0]);
+    int pad = core_alloc("pad", 100);
+    nodes[0] = core_alloc_ex("node", 500, &list_ops);
+    ((struct node*)core_get_data(nodes[0]))->index = 0;
+    ((struct node*)core_get_data(nodes[0]))->next = core_get_data(nodes[1]);
+    core_free(pad);
+    for (i = 0; i < NODES; i++)
+        before[i] = core_get_data(nodes[i]);
+    veto = true;
+    while (!core_compact_step(0));
+    for (i = 0; i < NODES; i++)
+        if (core_get_data(nodes[i]) != before[i]) error("%d moved\n", i);
+    check_list();
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "buflib_mt.h"
+
+/*
+ * Every thread allocates into its own context and hands its allocations to
+ * the next thread, which checks and frees them, so most frees are remote.
+ *
+ * Expected output:
+-------------------
+threads done
+contexts used: 4
+all contexts empty
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define THREADS 4
+#define ROUNDS 2000
+#define BATCH 32
+
+static char buffer[THREADS * (32<<10)];
+static struct buflib_mt_context mt;
+static pthread_barrier_t barrier;
+static int handles[THREADS][BATCH];
+
+static void *worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    int *mine = handles[id], *theirs = handles[(id + 1) % THREADS];
+    int i, round;
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < BATCH; i++)
+        {
+            size_t size = 16 + (round * 7 + i * 13) % 500;
+            mine[i] = buflib_mt_alloc_ex(&mt, size, "mt", NULL);
+            if (mine[i] <= 0)
+                error("thread %d: alloc failed\n", id);
+            memset(buflib_mt_get_data(&mt, mine[i]), id, size);
+        }
+        pthread_barrier_wait(&barrier);
+        for (i = 0; i < BATCH; i++)
+        {
+            /* the default callbacks don't move anything */
+            unsigned char *data = buflib_mt_get_data(&mt, theirs[i]);
+            if (data[0] != (id + 1) % THREADS)
+                error("thread %d: data corrupt\n", id);
+            buflib_mt_free(&mt, theirs[i]);
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+    int i, used = 0;
+    buflib_mt_init(&mt, buffer, sizeof(buffer), THREADS);
+    pthread_barrier_init(&barrier, NULL, THREADS);
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)(intptr_t)i);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    printf("threads done\n");
+
+    for (i = 0; i < THREADS; i++)
+        if (mt.parts[i].remote_head > 0)
+            used++;
+    printf("contexts used: %d\n", used);
+
+    buflib_mt_drain(&mt);
+    for (i = 0; i < THREADS; i++)
+    {
+        struct buflib_context *ctx = &mt.parts[i].ctx;
+        if (ctx->alloc_end != ctx->buf_start)
+            error("context %d not empty\n", i);
+    }
+    printf("all contexts empty\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Allocation names are stored once per context, whatever their length, and
+ * a name buffer that's reused for other names doesn't confuse them. The
+ * space of names is taken over by new ones once their allocations are gone.
+ *
+ * Expected output (64-bit):
+-------------------
+header: 16 bytes
+name space used: 68
+a very long name for lots of small allocations
+name 0, name 1, name 2
+(null)
+2000 names, 10 live: space used: 155
+kept
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+int main(void)
+{
+    const char *long_name = "a very long name for lots of small allocations";
+    char name[16];
+    int handles[100], named[3], live[10] = { 0 }, kept, i;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < 100; i++)
+    {
+        handles[i] = buflib_alloc_ex(&ctx, 16, long_name, NULL);
+        if (handles[i] <= 0) error("alloc %d failed\n", i);
+    }
+    printf("header: %ld bytes\n", (char*)buflib_get_data(&ctx, handles[1])
+                                - (char*)buflib_get_data(&ctx, handles[0]) - 16);
+
+    /* same memory, different names */
+    for (i = 0; i < 3; i++)
+    {
+        snprintf(name, sizeof(name), "name %d", i);
+        named[i] = buflib_alloc_ex(&ctx, 16, name, NULL);
+    }
+    printf("name space used: %zu\n", ctx.names.used);
+    printf("%s\n", buflib_get_name(&ctx, handles[99]));
+    printf("%s, %s, %s\n", buflib_get_name(&ctx, named[0]),
+           buflib_get_name(&ctx, named[1]), buflib_get_name(&ctx, named[2]));
+
+    int unnamed = buflib_alloc_ex(&ctx, 16, NULL, NULL);
+    printf("%s\n", buflib_get_name(&ctx, unnamed) ?: "(null)");
+
+    /* far more names than fit in at once, a few of them in use at a time */
+    for (i = 0; i < 100; i++)
+        buflib_free(&ctx, handles[i]);
+    for (i = 0; i < 3; i++)
+        buflib_free(&ctx, named[i]);
+    kept = buflib_alloc_ex(&ctx, 16, "kept", NULL);
+    for (i = 0; i < 2000; i++)
+    {
+        if (live[i % 10])
+            buflib_free(&ctx, live[i % 10]);
+        snprintf(name, sizeof(name), "transient %d", i);
+        live[i % 10] = buflib_alloc_ex(&ctx, 16, name, NULL);
+        if (live[i % 10] <= 0) error("alloc %d failed\n", i);
+        if (!buflib_get_name(&ctx, live[i % 10])
+                || strcmp(buflib_get_name(&ctx, live[i % 10]), name))
+            error("name %d lost\n", i);
+    }
+    for (i = 1990; i < 2000; i++)
+    {
+        snprintf(name, sizeof(name), "transient %d", i);
+        if (strcmp(buflib_get_name(&ctx, live[i % 10]), name))
+            error("name %d overwritten\n", i);
+    }
+    printf("2000 names, 10 live: space used: %zu\n", ctx.names.used);
+    printf("%s\n", buflib_get_name(&ctx, kept));
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Allocations with compact headers find their callbacks in a table of the
+ * context. Allocating with more distinct callbacks than it has room for
+ * still works, those allocations are kept in place and their callbacks
+ * aren't called. Compaction still finds the callbacks of every other
+ * allocation. Once the allocations of some callbacks are freed, their
+ * entries are taken by new ones.
+ *
+ * Expected output (64-bit):
+-------------------
+300 allocations
+moved some
+new ops moved after freeing
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (32<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+#define NUM_OPS 300
+static struct buflib_callbacks ops[NUM_OPS + 1];
+static int handles[NUM_OPS];
+static int moved;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    moved++;
+    return BUFLIB_CB_OK;
+}
+
+static int new_moved;
+static int new_move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    new_moved++;
+    return BUFLIB_CB_OK;
+}
+
+int main(void)
+{
+    int i, new_handle;
+    void *data[NUM_OPS];
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < NUM_OPS; i++)
+    {
+        ops[i].move_callback = move_callback;
+        handles[i] = buflib_alloc_ex(&ctx, 16, "ops", &ops[i]);
+        if (handles[i] <= 0)
+            error("alloc %d failed\n", i);
+    }
+    printf("%d allocations\n", NUM_OPS);
+
+    /* known ops still work when the table is full */
+    if (buflib_alloc_ex(&ctx, 16, "ops", &ops[0]) <= 0)
+        error("alloc with known ops failed\n");
+
+    /* allocations whose ops didn't fit stay where they are, the others are
+     * moved down by compaction */
+    for (i = 0; i < NUM_OPS; i++)
+        data[i] = buflib_get_data(&ctx, handles[i]);
+    for (i = 0; i < 10; i++)
+        buflib_free(&ctx, handles[i]);
+    buflib_compact_step(&ctx, 0);
+#ifdef BUFLIB_COMPACT_HEADER
+    /* the first ones took the table, but for the default callbacks */
+    for (i = BUFLIB_NUM_OPS - 1; i < NUM_OPS; i++)
+        if (buflib_get_data(&ctx, handles[i]) != data[i])
+            error("allocation %d moved\n", i);
+#endif
+    if (!moved)
+        error("nothing moved\n");
+    printf("moved %s\n", moved ? "some" : "none");
+
+    /* freeing made room in the table for callbacks that are called */
+    new_handle = buflib_alloc_ex(&ctx, 16, "ops", &ops[NUM_OPS]);
+    ops[NUM_OPS].move_callback = new_move_callback;
+    for (i = 10; i < NUM_OPS; i++)
+        buflib_free(&ctx, handles[i]);
+    buflib_compact_step(&ctx, 0);
+    if (new_handle <= 0 || !new_moved)
+        error("new ops not called\n");
+    printf("new ops moved after freeing\n");
+    return 0;
+}
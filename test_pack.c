@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Compaction packs the hole in front of an unmovable block with the biggest
+ * block behind it that fits, rather than the first one.
+ *
+ * Expected output (64-bit):
+-------------------
+fragmented: 1016
+fragmented after compaction: 96
+c moved in front of the unmovable block, b and d slid down
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static char* data(int handle)
+{
+    return buflib_get_data(&ctx, handle);
+}
+
+int main(void)
+{
+    int a, u, b, c, d;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    a = buflib_alloc_ex(&ctx, 1000, "a", &ops);
+    u = buflib_alloc_ex(&ctx, 200, "u", NULL);
+    b = buflib_alloc_ex(&ctx, 400, "b", &ops);
+    c = buflib_alloc_ex(&ctx, 900, "c", &ops);
+    d = buflib_alloc_ex(&ctx, 300, "d", &ops);
+    strcpy(data(b), "b");
+    strcpy(data(c), "c");
+    strcpy(data(d), "d");
+    buflib_free(&ctx, a);
+    printf("fragmented: %zu\n", buflib_fragmented(&ctx));
+
+    if (!buflib_compact_step(&ctx, 0))
+        error("compaction not complete\n");
+    printf("fragmented after compaction: %zu\n", buflib_fragmented(&ctx));
+    if (data(c) > data(u) || data(b) < data(u) || data(d) < data(b))
+        error("unexpected order\n");
+    if (strcmp(data(b), "b") || strcmp(data(c), "c") || strcmp(data(d), "d"))
+        error("data lost\n");
+    printf("c moved in front of the unmovable block, b and d slid down\n");
+    return 0;
+}
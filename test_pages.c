@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Free space of a context that returns pages goes back to the OS when big
+ * allocations are freed, small frees don't return anything.
+ *
+ * Expected output:
+-------------------
+reserved: 1024K
+small free returned: no
+hole returned: yes
+end returned: yes
+data intact
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define ALLOC_SIZE 60000
+static struct buflib_context ctx;
+
+int main(void)
+{
+    struct buflib_stats stats;
+    size_t before, after;
+    int handles[16], small, i;
+    if (!buflib_init_growable(&ctx, 1<<20, 1<<20))
+        error("can't reserve\n");
+    buflib_set_page_return(&ctx, 32<<10);
+
+    small = buflib_alloc(&ctx, 1000);
+    for (i = 0; i < 16; i++)
+    {
+        handles[i] = buflib_alloc(&ctx, ALLOC_SIZE);
+        if (handles[i] <= 0)
+            error("alloc %d failed\n", i);
+        memset(buflib_get_data(&ctx, handles[i]), i, ALLOC_SIZE);
+    }
+    buflib_get_stats(&ctx, &stats);
+    printf("reserved: %zuK\n", stats.reserved_bytes >> 10);
+    before = buflib_resident(&ctx);
+    if (before < 16 * ALLOC_SIZE)
+        error("only %zu bytes resident\n", before);
+
+    buflib_free(&ctx, small);
+    buflib_get_stats(&ctx, &stats);
+    printf("small free returned: %s\n", stats.returned_bytes ? "yes" : "no");
+
+    /* a hole between allocations keeps its bin links and boundary tag */
+    buflib_free(&ctx, handles[5]);
+    buflib_get_stats(&ctx, &stats);
+    after = buflib_resident(&ctx);
+    printf("hole returned: %s\n",
+           stats.returned_bytes >= 40<<10 && before - after >= 40<<10
+           ? "yes" : "no");
+
+    for (i = 15; i > 8; i--)
+        buflib_free(&ctx, handles[i]);
+    after = buflib_resident(&ctx);
+    printf("end returned: %s\n", before - after >= 300<<10 ? "yes" : "no");
+
+    /* what was returned is usable again */
+    handles[5] = buflib_alloc(&ctx, ALLOC_SIZE);
+    memset(buflib_get_data(&ctx, handles[5]), 5, ALLOC_SIZE);
+    for (i = 9; i < 16; i++)
+    {
+        handles[i] = buflib_alloc(&ctx, ALLOC_SIZE);
+        memset(buflib_get_data(&ctx, handles[i]), i, ALLOC_SIZE);
+    }
+    for (i = 0; i < 16; i++)
+    {
+        unsigned char *data = buflib_get_data(&ctx, handles[i]);
+        if (data[0] != i || data[ALLOC_SIZE-1] != i)
+            error("data of %d lost\n", i);
+    }
+    printf("data intact\n");
+    buflib_release(&ctx);
+    return 0;
+}
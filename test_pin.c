@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "proposed-api.h"
+
+/*
+ * A pinned allocation stays in place while compaction moves everything
+ * around it, and moves again after it's unpinned.
+ *
+ * Expected output:
+-------------------
+pinned stayed, 9 moves
+unpinned moved, 1 moves
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+static int moves;
+static int pinned_handle;
+static int move_callback(int handle, void* old, void* new)
+{
+    (void)old;(void)new;
+    if (handle == pinned_handle)
+        error("callback of the pinned allocation called\n");
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+#define NUM 20
+int main(void)
+{
+    int handles[NUM], i;
+    buflib_core_init();
+
+    for (i = 0; i < NUM; i++)
+    {
+        handles[i] = core_alloc_ex("chunk", 1000, &ops);
+        if (handles[i] <= 0) error("alloc %d failed\n", i);
+    }
+    for (i = 0; i < NUM/2; i++)
+        core_free(handles[i]);
+
+    pinned_handle = handles[NUM/2 + 5];
+    char *data = core_get_data(pinned_handle);
+    core_pin(pinned_handle);
+    core_pin(pinned_handle);
+    core_unpin(pinned_handle); /* pins nest */
+    while (!core_compact_step(0));
+    if (core_get_data(pinned_handle) != data)
+        error("pinned allocation moved\n");
+    printf("pinned stayed, %d moves\n", moves);
+
+    moves = 0;
+    core_unpin(pinned_handle);
+    pinned_handle = 0;
+    while (!core_compact_step(0));
+    if (core_get_data(handles[NUM/2 + 5]) == data)
+        error("unpinned allocation didn't move\n");
+    printf("unpinned moved, %d moves\n", moves);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Grows allocations in place into the free space at the end and into a
+ * free block after them, after compacting, and by copying them. Shrinking
+ * and refusing to copy pinned allocations are covered, too.
+ *
+ * Expected output:
+-------------------
+grown at the end in place
+grown into the next block in place
+grown in place after 1 moves
+grown by copying
+shrunk
+pinned not copied
+grown at the end during compaction
+grown by copying into a grown context
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static int moves;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static int alloc(size_t size, int fill)
+{
+    int handle = buflib_alloc_ex(&ctx, size, "data", &ops);
+    if (handle <= 0) error("alloc %zu failed\n", size);
+    memset(buflib_get_data(&ctx, handle), fill, size);
+    return handle;
+}
+
+static void check(int handle, size_t size, int fill)
+{
+    unsigned char *data = buflib_get_data(&ctx, handle);
+    size_t i;
+    for (i = 0; i < size; i++)
+        if (data[i] != fill)
+            error("handle %d: byte %zu is %d, not %d\n", handle, i, data[i], fill);
+}
+
+int main(void)
+{
+    int a, b, c, d;
+    char *data;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    a = alloc(1000, 1);
+    data = buflib_get_data(&ctx, a);
+    if (!buflib_realloc(&ctx, a, 3000) || buflib_get_data(&ctx, a) != data)
+        error("growing at the end failed\n");
+    check(a, 1000, 1);
+    printf("grown at the end in place\n");
+    buflib_free(&ctx, a);
+
+    a = alloc(1000, 1);
+    b = alloc(2000, 2);
+    c = alloc(1000, 3);
+    buflib_free(&ctx, b);
+    data = buflib_get_data(&ctx, a);
+    if (!buflib_realloc(&ctx, a, 2500) || buflib_get_data(&ctx, a) != data)
+        error("growing into the next block failed\n");
+    check(a, 1000, 1);
+    check(c, 1000, 3);
+    printf("grown into the next block in place\n");
+    buflib_free(&ctx, a);
+    buflib_free(&ctx, c);
+
+    /* a is last, with not enough space after it but in front */
+    b = alloc(8000, 2);
+    a = alloc(1000, 1);
+    buflib_free(&ctx, b);
+    moves = 0;
+    if (!buflib_realloc(&ctx, a, 10000))
+        error("growing after compaction failed\n");
+    check(a, 1000, 1);
+    printf("grown in place after %d moves\n", moves);
+    buflib_free(&ctx, a);
+
+    /* a is stuck between b and c */
+    a = alloc(1000, 1);
+    b = alloc(1000, 2);
+    c = alloc(1000, 3);
+    buflib_free(&ctx, a);
+    data = buflib_get_data(&ctx, b);
+    if (!buflib_realloc(&ctx, b, 4000) || buflib_get_data(&ctx, b) == data)
+        error("growing by copying failed\n");
+    check(b, 1000, 2);
+    check(c, 1000, 3);
+    if (ctx.stats.live_handles != 2)
+        error("%d allocations\n", ctx.stats.live_handles);
+    printf("grown by copying\n");
+
+    if (!buflib_realloc(&ctx, b, 500))
+        error("shrinking failed\n");
+    check(b, 500, 2);
+    printf("shrunk\n");
+
+    /* c is stuck between b and a */
+    a = alloc(1000, 1);
+    buflib_pin(&ctx, c);
+    if (buflib_realloc(&ctx, c, 4000))
+        error("pinned allocation copied\n");
+    check(c, 1000, 3);
+    printf("pinned not copied\n");
+
+    /* a pass in progress rests at alloc_end after the frees, growing the
+     * last allocation mustn't leave it inside of it */
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+    a = alloc(100, 1);
+    b = alloc(100, 2);
+    c = alloc(100, 3);
+    d = alloc(100, 4);
+    buflib_free(&ctx, a);
+    buflib_compact_step(&ctx, 1);
+    buflib_free(&ctx, d);
+    buflib_free(&ctx, c);
+    if (!buflib_realloc(&ctx, b, 400))
+        error("growing during compaction failed\n");
+    memset(buflib_get_data(&ctx, b), 0xf0, 400);
+    buflib_compact_step(&ctx, 0);
+    check(b, 400, 0xf0);
+    printf("grown at the end during compaction\n");
+
+#ifdef BUFLIB_HAVE_VM
+    /* the copy needs the context to grow, which moves the handle table */
+    if (!buflib_init_growable(&ctx, 4096, 1<<20))
+        error("can't reserve\n");
+    a = alloc(1000, 1);
+    b = alloc(1000, 2);
+    if (!buflib_realloc(&ctx, a, 6000) || !ctx.stats.grows)
+        error("growing by copying into a grown context failed\n");
+    check(a, 1000, 1);
+    check(b, 1000, 2);
+    if (ctx.stats.live_handles != 2)
+        error("%d allocations\n", ctx.stats.live_handles);
+    buflib_release(&ctx);
+#endif
+    printf("grown by copying into a grown context\n");
+    return 0;
+}
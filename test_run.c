@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Adjacent blocks are moved together after all of their owners were told,
+ * until then they're at their old place.
+ *
+ * Expected output:
+-------------------
+moving b, b is still in place
+moving c, b is still in place
+moving d, b is still in place
+moved 3072 bytes: b c d
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static void *old_b;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)new;
+    if (buflib_get_data(&ctx, handle) != current)
+        error("handle %d already moved\n", handle);
+    printf("moving %s, b is %s in place\n", (char*)current,
+           !strcmp(old_b, "b") ? "still" : "not");
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+int main(void)
+{
+    struct buflib_stats stats;
+    int gone, h[3], i;
+    const char *names[] = { "b", "c", "d" };
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    gone = buflib_alloc_ex(&ctx, 1000, "gone", &ops);
+    for (i = 0; i < 3; i++)
+    {
+        h[i] = buflib_alloc_ex(&ctx, 1008, names[i], &ops);
+        strcpy(buflib_get_data(&ctx, h[i]), names[i]);
+    }
+    old_b = buflib_get_data(&ctx, h[0]);
+    buflib_free(&ctx, gone);
+    if (!buflib_compact_step(&ctx, 0))
+        error("compaction not complete\n");
+
+    buflib_get_stats(&ctx, &stats);
+    printf("moved %lu bytes: %s %s %s\n", stats.moved_bytes,
+           (char*)buflib_get_data(&ctx, h[0]), (char*)buflib_get_data(&ctx, h[1]),
+           (char*)buflib_get_data(&ctx, h[2]));
+    return 0;
+}
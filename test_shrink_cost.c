@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Shrinkable allocations are asked in the order of their shrink cost, and
+ * only until the allocation that needs the space fits.
+ *
+ * Expected output:
+-------------------
+alloc 1000
+shrink cheap
+alloc 1000
+shrink cheap
+shrink cheap
+alloc 4000
+shrink cheap
+shrink cheap
+shrink expensive
+shrink cheap
+shrink cheap
+shrink expensive
+shrink calls: 9
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static int shrink_callback(int handle, unsigned hints, void* start, size_t size)
+{
+    (void)hints;
+    printf("shrink %s\n", buflib_get_name(&ctx, handle));
+    if (buflib_shrink(&ctx, handle, start, size / 2))
+        return BUFLIB_CB_OK;
+    return BUFLIB_CB_CANNOT_SHRINK;
+}
+
+static struct buflib_callbacks expensive_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = shrink_callback,
+    .shrink_cost = 10,
+};
+
+static struct buflib_callbacks rest_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static struct buflib_callbacks cheap_ops = {
+    .move_callback = move_callback,
+    .shrink_callback = shrink_callback,
+};
+
+int main(void)
+{
+    struct buflib_stats stats;
+    size_t size;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    buflib_alloc_ex(&ctx, 4000, "expensive", &expensive_ops);
+    buflib_alloc_ex(&ctx, 4000, "cheap", &cheap_ops);
+    buflib_alloc_ex(&ctx, 4000, "cheap", &cheap_ops);
+    size = buflib_available(&ctx);
+    buflib_alloc_ex(&ctx, size, "rest", &rest_ops);
+
+    /* half of one cheap allocation is enough */
+    printf("alloc 1000\n");
+    if (buflib_alloc(&ctx, 1000) <= 0)
+        error("first alloc failed\n");
+    /* needs both, the other one is already half its size */
+    printf("alloc 1000\n");
+    if (buflib_alloc(&ctx, 1000) <= 0)
+        error("second alloc failed\n");
+    /* the cheap ones can't make this fit */
+    printf("alloc 4000\n");
+    if (buflib_alloc(&ctx, 4000) <= 0)
+        error("third alloc failed\n");
+    buflib_get_stats(&ctx, &stats);
+    printf("shrink calls: %lu\n", stats.shrink_calls);
+    return 0;
+}
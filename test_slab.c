@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+#include "buflib_slab.h"
+
+/*
+ * Packs small objects into slabs, with plain allocations in between that
+ * are freed again so that compaction moves the slabs. References stay valid
+ * throughout.
+ *
+ * Expected output (64-bit):
+-------------------
+3000 objects in 18 allocations
+1500 objects moved intact
+empty: 1 allocations
+destroyed: 0 allocations
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (256<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static struct buflib_slab slab;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+struct object {
+    int tag;
+    char text[20];
+};
+
+#define NUM 3000
+static int refs[NUM];
+static int blobs[NUM / 100];
+
+int main(void)
+{
+    int i, intact = 0;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+    buflib_slab_init(&slab, &ctx, sizeof(struct object), 0, "objects");
+
+    for (i = 0; i < NUM; i++)
+    {
+        if (i % 100 == 0)
+            blobs[i / 100] = buflib_alloc_ex(&ctx, 2000, "blob", &ops);
+        refs[i] = buflib_slab_alloc(&slab);
+        if (refs[i] <= 0) error("alloc %d failed\n", i);
+        struct object *o = buflib_slab_get(&slab, refs[i]);
+        o->tag = i;
+        snprintf(o->text, sizeof(o->text), "object %d", i);
+    }
+    printf("%d objects in %d allocations\n", NUM,
+           ctx.stats.live_handles - NUM / 100);
+
+    for (i = 0; i < NUM / 100; i++)
+        buflib_free(&ctx, blobs[i]);
+    for (i = 0; i < NUM; i += 2)
+        buflib_slab_free(&slab, refs[i]);
+    buflib_compact_step(&ctx, 0);
+    if (buflib_fragmented(&ctx))
+        error("not compacted\n");
+    for (i = 1; i < NUM; i += 2)
+    {
+        char text[20];
+        struct object *o = buflib_slab_get(&slab, refs[i]);
+        snprintf(text, sizeof(text), "object %d", i);
+        if (o->tag == i && !strcmp(o->text, text))
+            intact++;
+    }
+    printf("%d objects moved intact\n", intact);
+
+    /* freed objects are handed out again */
+    for (i = 0; i < NUM; i += 2)
+        if ((refs[i] = buflib_slab_alloc(&slab)) <= 0)
+            error("realloc %d failed\n", i);
+    for (i = 0; i < NUM; i++)
+        buflib_slab_free(&slab, refs[i]);
+    printf("empty: %d allocations\n", ctx.stats.live_handles);
+    buflib_slab_destroy(&slab);
+    printf("destroyed: %d allocations\n", ctx.stats.live_handles);
+    return 0;
+}
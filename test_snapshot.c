@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * A context saved with buflib_snapshot() is brought back by buflib_restore()
+ * into a buffer elsewhere, the owners fix up their pointers through their
+ * move callbacks. Restoring at the same place needs no callbacks. Snapshots
+ * bigger than a pipe takes at once go through one. Damaged snapshots are
+ * refused, leaving the context empty.
+ *
+ * Expected output:
+-------------------
+restored elsewhere, 2 moved
+list: second -> first
+plain: plain data
+restored in place, 0 moved
+list: second -> first
+through a pipe: 200000 bytes
+truncated: refused
+zero length: refused
+too long: refused
+bad handle entry: refused
+corrupted units: no crashes
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buffer1[BUFLIB_BUFFER_SIZE], buffer2[BUFLIB_BUFFER_SIZE * 2];
+static struct buflib_context ctx;
+static int moves;
+
+/* an allocation pointing into itself */
+struct node
+{
+    char *text;
+    char buf[32];
+};
+
+/* only called by restoring here, the data is at new already then */
+static int move_callback(int handle, void* current, void* new)
+{
+    struct node *node = new;
+    (void)handle;
+    node->text += (char*)new - (char*)current;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static struct buflib_callbacks* get_ops(const char *name)
+{
+    return strcmp(name, "list") ? NULL : &ops;
+}
+
+static char big1[256<<10], big2[256<<10];
+static char saved[BUFLIB_BUFFER_SIZE];
+static size_t saved_size;
+static bool fuzzing;
+
+/* Restore from the saved snapshot with the unit at offset from the end set
+ * to val (no change if offset is 0), cut short by cut bytes */
+static bool restore_damaged(size_t offset, intptr_t val, size_t cut)
+{
+    FILE *file = tmpfile();
+    bool ret;
+    if (!file) error("no tmpfile\n");
+    fwrite(saved, 1, saved_size - cut, file);
+    if (offset)
+    {
+        fseek(file, saved_size - offset, SEEK_SET);
+        fwrite(&val, sizeof(val), 1, file);
+    }
+    fflush(file);
+    rewind(file);
+    buflib_init(&ctx, buffer2, sizeof(buffer2));
+    /* the data isn't checked, damaged nodes can't be moved */
+    ret = buflib_restore(&ctx, fileno(file), fuzzing ? NULL : get_ops);
+    fclose(file);
+    if (!ret && (ctx.stats.live_handles || buflib_alloc(&ctx, 100) <= 0))
+        error("context not cleared\n");
+    return ret;
+}
+
+static void print_list(int first, int second)
+{
+    struct node *a = buflib_get_data(&ctx, first),
+                *b = buflib_get_data(&ctx, second);
+    printf("list: %s -> %s\n", b->text, a->text);
+}
+
+int main(void)
+{
+    int first, second, plain, gone;
+    struct node *node;
+    FILE *file = tmpfile();
+    if (!file) error("no tmpfile\n");
+    buflib_init(&ctx, buffer1, BUFLIB_BUFFER_SIZE);
+
+    first = buflib_alloc_ex(&ctx, sizeof(struct node), "list", &ops);
+    gone = buflib_alloc(&ctx, 100);
+    second = buflib_alloc_ex(&ctx, sizeof(struct node), "list", &ops);
+    plain = buflib_alloc_ex(&ctx, 100, "plain", NULL);
+    node = buflib_get_data(&ctx, first);
+    strcpy(node->buf, "first");
+    node->text = node->buf;
+    node = buflib_get_data(&ctx, second);
+    strcpy(node->buf, "second");
+    node->text = node->buf;
+    strcpy(buflib_get_data(&ctx, plain), "plain data");
+    buflib_free(&ctx, gone);
+    if (!buflib_snapshot(&ctx, fileno(file)))
+        error("snapshot failed\n");
+
+    buflib_init(&ctx, buffer2, sizeof(buffer2));
+    rewind(file);
+    if (!buflib_restore(&ctx, fileno(file), get_ops))
+        error("restore failed\n");
+    printf("restored elsewhere, %d moved\n", moves);
+    print_list(first, second);
+    printf("%s: %s\n", buflib_get_name(&ctx, plain),
+           (char*)buflib_get_data(&ctx, plain));
+    /* the freed handle and the hole are usable */
+    if (buflib_alloc(&ctx, 50) != gone)
+        error("freed handle not reused\n");
+
+    moves = 0;
+    buflib_init(&ctx, buffer1, BUFLIB_BUFFER_SIZE);
+    rewind(file);
+    if (!buflib_restore(&ctx, fileno(file), get_ops))
+        error("restore failed\n");
+    printf("restored in place, %d moved\n", moves);
+    print_list(first, second);
+
+    /* reads and writes of a pipe are cut into pieces */
+    {
+        struct buflib_context big;
+        int fds[2], status, handle;
+        pid_t pid;
+        buflib_init(&big, big1, sizeof(big1));
+        handle = buflib_alloc(&big, 200000);
+        memset(buflib_get_data(&big, handle), 0x5a, 200000);
+        if (pipe(fds))
+            error("no pipe\n");
+        pid = fork();
+        if (pid < 0)
+            error("no fork\n");
+        if (!pid)
+            _exit(!buflib_snapshot(&big, fds[1]));
+        close(fds[1]);
+        buflib_init(&big, big2, sizeof(big2));
+        if (!buflib_restore(&big, fds[0], NULL))
+            error("restore from a pipe failed\n");
+        close(fds[0]);
+        if (waitpid(pid, &status, 0) != pid || status)
+            error("snapshot to a pipe failed\n");
+        char *data = buflib_get_data(&big, handle);
+        if (data[0] != 0x5a || data[199999] != 0x5a)
+            error("data lost in the pipe\n");
+        printf("through a pipe: %d bytes\n", 200000);
+    }
+
+    /* from the end: the handle table, then the blocks */
+    size_t handles = (ctx.handle_table - ctx.last_handle) * sizeof(intptr_t),
+           blocks = (ctx.alloc_end - ctx.buf_start) * sizeof(intptr_t);
+    rewind(file);
+    saved_size = fread(saved, 1, sizeof(saved), file);
+    printf("truncated: %s\n",
+           restore_damaged(0, 0, 8) ? "restored" : "refused");
+    printf("zero length: %s\n", restore_damaged(handles + blocks, 0, 0)
+                                 ? "restored" : "refused");
+    printf("too long: %s\n", restore_damaged(handles + blocks, 1 << 20, 0)
+                              ? "restored" : "refused");
+    printf("bad handle entry: %s\n",
+           restore_damaged(first * sizeof(intptr_t), 0, 0)
+           ? "restored" : "refused");
+    /* anything may be refused, but nothing may crash */
+    fuzzing = true;
+    for (size_t offset = sizeof(intptr_t); offset <= handles + blocks;
+         offset += sizeof(intptr_t))
+    {
+        restore_damaged(offset, 0, 0);
+        restore_damaged(offset, -1, 0);
+        restore_damaged(offset, 1, 0);
+        restore_damaged(offset, INTPTR_MAX, 0);
+        restore_damaged(offset, INTPTR_MIN, 0);
+    }
+    printf("corrupted units: no crashes\n");
+    return 0;
+}
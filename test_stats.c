@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Follows the statistics of a context through allocating, freeing,
+ * compaction and a failed allocation.
+ *
+ * Expected output (64-bit):
+-------------------
+live 10 (10160 bytes), free 6144 bytes, largest 6144, 0 holes
+live 5 (5080 bytes), free 11224 bytes, largest 6144, 5 holes
+live 6 (12096 bytes), free 4208 bytes, largest 4208, 0 holes
+1 compactions, 5 moved (5080 bytes)
+1 failed allocations
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+static int moves;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    moves++;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static void print_stats(void)
+{
+    struct buflib_stats stats;
+    buflib_get_stats(&ctx, &stats);
+    printf("live %d (%zu bytes), free %zu bytes, largest %zu, %d holes\n",
+           stats.live_handles, stats.live_bytes, stats.free_bytes,
+           stats.largest_free, stats.holes);
+}
+
+#define NUM 10
+int main(void)
+{
+    struct buflib_stats stats;
+    int handles[NUM], i;
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < NUM; i++)
+    {
+        handles[i] = buflib_alloc_ex(&ctx, 1000, "chunk", &ops);
+        if (handles[i] <= 0) error("alloc %d failed\n", i);
+    }
+    print_stats();
+
+    for (i = 0; i < NUM; i += 2)
+        buflib_free(&ctx, handles[i]);
+    print_stats();
+
+    if (buflib_alloc_ex(&ctx, 7000, "big", &ops) <= 0)
+        error("big alloc failed\n");
+    print_stats();
+    buflib_get_stats(&ctx, &stats);
+    printf("%lu compactions, %d moved (%llu bytes)\n", stats.compactions,
+           moves, (unsigned long long)stats.moved_bytes);
+
+    if (buflib_alloc_ex(&ctx, 8000, "too big", &ops) > 0)
+        error("too big alloc succeeded\n");
+    buflib_get_stats(&ctx, &stats);
+    printf("%lu failed allocations\n", stats.alloc_failures);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Several threads allocate, fill, check and free on one context set up with
+ * buflib_init_locked(), while another one repeatedly grabs the whole buffer
+ * with buflib_alloc_maximum() and gives it back.
+ *
+ * Expected output:
+-------------------
+threads done
+empty
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (64<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+#define THREADS 4
+#define ROUNDS 20000
+#define SLOTS 8
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+static void *churn(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    int handles[SLOTS] = { 0 };
+    size_t sizes[SLOTS];
+    unsigned seed = id;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        int slot = rand_r(&seed) % SLOTS;
+        if (handles[slot] > 0)
+        {
+            /* compaction in other threads moves the data, so look at it
+             * under the lock only */
+            buflib_lock(&ctx);
+            unsigned char *data = buflib_get_data(&ctx, handles[slot]);
+            if (data[0] != id || data[sizes[slot]-1] != id)
+                error("thread %d: data corrupt\n", id);
+            buflib_unlock(&ctx);
+            buflib_free(&ctx, handles[slot]);
+            handles[slot] = 0;
+        }
+        else
+        {
+            sizes[slot] = 1 + rand_r(&seed) % 1000;
+            handles[slot] = buflib_alloc_ex(&ctx, sizes[slot], "churn", &ops);
+            if (handles[slot] <= 0)
+                continue;
+            buflib_lock(&ctx);
+            memset(buflib_get_data(&ctx, handles[slot]), id, sizes[slot]);
+            buflib_unlock(&ctx);
+        }
+    }
+    for (i = 0; i < SLOTS; i++)
+        if (handles[i] > 0)
+            buflib_free(&ctx, handles[i]);
+    return NULL;
+}
+
+static void *grab(void *arg)
+{
+    (void)arg;
+    int i;
+    for (i = 0; i < ROUNDS/100; i++)
+    {
+        size_t size;
+        int handle = buflib_alloc_maximum(&ctx, "grab", &size, &ops);
+        if (handle <= 0)
+            continue;
+        /* the other threads wait in buflib_alloc_ex() meanwhile */
+        buflib_shrink(&ctx, handle, buflib_get_data(&ctx, handle), size/2);
+        buflib_free(&ctx, handle);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS+1];
+    int i;
+    buflib_init_locked(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void*)(intptr_t)(i+1));
+    pthread_create(&threads[THREADS], NULL, grab, NULL);
+    for (i = 0; i <= THREADS; i++)
+        pthread_join(threads[i], NULL);
+    printf("threads done\n");
+
+    if (ctx.alloc_end != ctx.buf_start)
+        error("not empty\n");
+    printf("empty\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buflib.h"
+#include "new_apis.h"
+
+/*
+ * Records a few calls and reads the trace back.
+ *
+ * Expected output:
+-------------------
+init 16384
+alloc 1: 1000 bytes, name 5, movable
+alloc 2: 500 bytes, name 11
+shrink 1: +100, 800 bytes
+free 2
+buffer out 0 -> 15456
+buffer in 15456
+free 1
+-------------------
+*/
+
+#define error(...) do { printf(__VA_ARGS__); exit(1); } while(0)
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+int main(void)
+{
+    struct buflib_trace_record r;
+    FILE *trace = tmpfile();
+    size_t size = 0;
+    if (!trace) error("no tmpfile\n");
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+
+    buflib_trace_start(&ctx, trace);
+    int a = buflib_alloc_ex(&ctx, 1000, "chunk", &ops);
+    int b = buflib_alloc(&ctx, 500);
+    buflib_shrink(&ctx, a, (char*)buflib_get_data(&ctx, a) + 100, 800);
+    buflib_free(&ctx, b);
+    buflib_buffer_out(&ctx, &size);
+    buflib_buffer_in(&ctx, size);
+    buflib_free(&ctx, a);
+    buflib_trace_stop(&ctx);
+    /* not recorded anymore */
+    buflib_free(&ctx, buflib_alloc(&ctx, 10));
+
+    rewind(trace);
+    while (fread(&r, sizeof(r), 1, trace) == 1)
+    {
+        switch (r.op)
+        {
+            case BUFLIB_TRACE_INIT:
+                printf("init %u\n", r.a);
+                break;
+            case BUFLIB_TRACE_ALLOC:
+                printf("alloc %d: %u bytes, name %u%s\n", r.handle, r.a,
+                       r.b & BUFLIB_TRACE_NAME_MASK,
+                       r.b & BUFLIB_TRACE_MOVABLE ? ", movable" : "");
+                break;
+            case BUFLIB_TRACE_SHRINK:
+                printf("shrink %d: +%u, %u bytes\n", r.handle, r.a, r.b);
+                break;
+            case BUFLIB_TRACE_FREE:
+                printf("free %d\n", r.handle);
+                break;
+            case BUFLIB_TRACE_BUFFER_OUT:
+                printf("buffer out %u -> %u\n", r.a, r.b);
+                break;
+            case BUFLIB_TRACE_BUFFER_IN:
+                printf("buffer in %u\n", r.a);
+                break;
+            default:
+                error("unexpected record %u\n", r.op);
+        }
+    }
+    return 0;
+}